@@ -6,11 +6,24 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/.
  */
 
+/* sigaction(2) and friends aren't part of ANSI C. */
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "rawline.h"
 
@@ -27,6 +40,12 @@ static void *_raw_malloc(size_t size) {
 	return ret;
 } /* _raw_malloc() */
 
+static void *_raw_calloc(size_t nmemb, size_t size) {
+	void *ret = calloc(nmemb, size);
+	assert(ret != NULL, "couldn't allocate enough memory");
+	return ret;
+} /* _raw_calloc() */
+
 static void *_raw_realloc(void *ptr, size_t size) {
 	void *ret = realloc(ptr, size);
 	assert(ret != NULL, "couldn't allocate enough memory");
@@ -36,15 +55,27 @@ static void *_raw_realloc(void *ptr, size_t size) {
 /* Convert bool-ish ints to bools. */
 #define BOOL(b) (!!b)
 
-/* VT100 control codes used by rawline. It is assumed the code using these printf-style
- * control code formats knows the amount of args (or things to be subbed in), so we don't
- * need to use functions for these. */
+/* VT100 control codes used by rawline. Codes which take an argument are given as the final byte
+ * of the CSI sequence, and are formatted (without stdio) by _raw_out_csi(). */
 
 #define C_BELL				"\x7"		/* BEL -- Ring the terminal bell. */
 #define C_LN_CLEAR_END		"\x1b[0K"	/* EL(0) -- Clear from cursor to EOL */
+#define C_SCR_CLEAR_END		"\x1b[0J"	/* ED(0) -- Clear from cursor to end of screen */
+#define C_CUR_LINE_START	"\r"		/* CR -- Move cursor to the start of the row */
+#define C_CUR_NEXT_LINE		"\r\n"		/* CR LF -- Move cursor to the start of the next row */
 
-#define C_CUR_MOVE_FORWARD	"\x1b[%dC"
-#define C_CUR_MOVE_BACK		"\x1b[%dD"
+#define C_FG_GREY			"\x1b[90m"	/* SGR 90 -- Set the foreground colour to grey (bright black) */
+#define C_FG_DEFAULT		"\x1b[39m"	/* SGR 39 -- Set the foreground colour back to the default */
+
+#define C_PASTE_ON			"\x1b[?2004h"	/* Enable bracketed paste mode */
+#define C_PASTE_OFF			"\x1b[?2004l"	/* Disable bracketed paste mode */
+#define C_PASTE_END			"\x1b[201~"	/* Marks the end of a bracketed paste */
+
+#define C_CSI				"\x1b["		/* CSI -- Control Sequence Introducer */
+#define C_CUR_MOVE_UP		'A'			/* CUU(n) -- Move cursor up n rows */
+#define C_CUR_MOVE_DOWN		'B'			/* CUD(n) -- Move cursor down n rows */
+#define C_CUR_MOVE_FORWARD	'C'			/* CUF(n) -- Move cursor forward n columns */
+#define C_CUR_MOVE_BACK		'D'			/* CUB(n) -- Move cursor back n columns */
 
 /* Structures used internally by rawline. External structures end with _t. */
 
@@ -53,44 +84,267 @@ struct _raw_str {
 	int len; /* length of string (no more strlen!) */
 };
 
+struct _raw_buf {
+	char *buf; /* byte buffer (not null terminated) */
+	int len; /* number of bytes used */
+	int size; /* allocated size of buf */
+};
+
+struct _raw_gap {
+	char *buf; /* gap buffer (the text is buf[0, start) followed by buf[end, size)) */
+	int size; /* allocated size of buf */
+	int start; /* start of the gap */
+	int end; /* end of the gap (first char after the gap) */
+	int len; /* length of text (no more strlen!) */
+};
+
 struct _raw_line {
 	struct _raw_str *prompt; /* prompt "string" */
-	struct _raw_str *line; /* input line */
+	int pwidth; /* number of columns taken up by the prompt on the terminal */
+	struct _raw_gap *line; /* input line (stored as a gap buffer, so edits at the cursor don't copy the line) */
 	int cursor; /* cursor position in line (relative to end of prompt) */
-	int oldcursor; /* old cursor position in line (relative to end of prompt) */
+	int oldcursor; /* cursor position on the terminal (in columns, relative to end of prompt) */
+	int oldlen; /* length of the line as it is drawn on the terminal (in columns) */
+	int dirty; /* first position in line changed since the last redraw (-1 if nothing changed) */
+	bool changed; /* has the line changed since it was last taken from the history? */
+
+	bool suggesting; /* are history items suggested after the line? */
+	int suggest; /* sequence number of the history item suggested on the terminal (-1 if there isn't one) */
+	int suggestfrom; /* position in the line the suggestion on the terminal starts at */
+	int suggestcol; /* column the suggestion on the terminal starts at */
 };
 
 struct _raw_term {
 	int fd; /* terminal file descriptor */
+	int ofd; /* terminal output file descriptor */
+	struct _raw_buf *out; /* output buffer, holding the frame to be written to ofd */
+	struct _raw_buf *in; /* input buffer, holding bytes read from fd which haven't been decoded yet */
+	int inpos; /* position of the next byte to decode in the input buffer */
+
+	int cols; /* cached width of the terminal */
+	int winch; /* value of _raw_winch when cols was last updated */
 	bool mode; /* is the terminal in raw mode? */
 	struct termios original; /* original terminal settings */
 };
 
+struct _raw_trie {
+	unsigned char ch; /* byte of the sequence leading to this node */
+	int key; /* key given by the sequence ending at this node (RAW_KEY_NONE if the sequence isn't finished) */
+	int child; /* first child of this node (0 if none) */
+	int next; /* next sibling of this node (0 if none) */
+};
+
+struct _raw_keys {
+	int (*bind[RAW_KEY_MAX])(struct raw_t *, int); /* callback bound to each key (NULL rings the bell) */
+	int timeout; /* how long to wait for a sequence after an ESC (in milliseconds) */
+
+	struct _raw_trie *trie; /* escape sequences (trie[0] is the root, which is reached by an ESC) */
+	int trielen; /* number of nodes in trie */
+	int triesize; /* allocated number of nodes in trie */
+
+	int state; /* state of the key decoder */
+	int node; /* current trie node, while in an escape sequence */
+	bool csi; /* is the current escape sequence a CSI sequence (ESC [)? */
+
+	struct _raw_buf *paste; /* text of the bracketed paste being decoded */
+	int pastematch; /* how much of the end of paste marker has been matched */
+};
+
+struct _raw_edit {
+	int seq; /* sequence number of the edited item (-1 if the bucket is empty) */
+	char *str; /* edited version of the item */
+};
+
+struct _raw_chunk {
+	struct _raw_chunk *prev; /* previous (older) chunk */
+	struct _raw_chunk *next; /* next (newer) chunk */
+	int size; /* size of the chunk (including this header) */
+	int used; /* number of bytes used (including this header) */
+	int live; /* number of items in the chunk which are still in the history */
+};
+
+struct _raw_gram {
+	uint32_t gram; /* bytes of the trigram plus one, see _raw_gram_of() (0 if the bucket is empty) */
+	int *seqs; /* sequence numbers of the items containing the trigram (from the oldest item to the latest) */
+	int start; /* first sequence number in seqs which is still used (evicted items are dropped from the front) */
+	int len; /* number of sequence numbers in seqs */
+	int size; /* allocated size of seqs */
+};
+
+struct _raw_frecency {
+	int uses; /* number of times the item has been used (0 if it isn't known, which counts as once) */
+	time_t used; /* when the item was last used (0 if it isn't known) */
+};
+
+struct _raw_rank {
+	int *seqs; /* sequence numbers of the best items found so far, as a heap with the worst of them at the top */
+	int len; /* number of sequence numbers in seqs */
+	int size; /* number of items being ranked (the allocated size of seqs) */
+	time_t now; /* time the items are being ranked at */
+};
+
 struct _raw_hist {
-	char **history; /* entire history (stored in reverse, where history[0] is the latest history item) */
-	char *original; /* original input (position history[-1]) */
+	char **history; /* entire history (a ring buffer of max slots, see _raw_hist_at()) */
+	struct _raw_chunk *chunks; /* arena chunks holding the items (from the oldest chunk to the latest) */
+	struct _raw_chunk *chunk; /* latest chunk, which new items are added to */
+	char *original; /* original input (history index -1) */
+	struct _raw_edit *edits; /* items edited while browsing the history for the current line (hash table, NULL until the first edit) */
+	int editsize; /* number of buckets in edits */
+	int editlen; /* number of edited items in edits */
 	char *buffer; /* stores buffer of serialised history */
 
-	int len; /* size of history */
+	char *map; /* mapped history file (NULL if none, see raw_hist_map()) */
+	size_t mapsize; /* size of the mapping */
+	uint32_t *mapindex; /* offset of each item in the mapping (from the oldest item to the latest) */
+	int mapcount; /* number of items in the mapping (they have the sequence numbers [0, mapcount)) */
+
+	int *dups; /* hash table from items to their sequence numbers, for erasing older duplicates (NULL until needed) */
+	int dupsize; /* number of buckets in dups */
+	int dupused; /* number of buckets in dups which aren't empty (including removed items) */
+	int erased; /* number of erased items still taking up a slot in the history */
+
+	struct _raw_frecency *frecency; /* use counters of each slot in history (NULL unless frecency is kept) */
+
+	struct _raw_gram *grams; /* trigram index of the items, for searching (NULL until the history is loaded or searched) */
+	int gramsize; /* number of buckets in grams */
+	int gramlen; /* number of trigrams in grams */
+
+	int *sorted; /* sequence numbers of the items sorted by item, for prefix navigation (NULL until needed) */
+	int sortedlen; /* number of sequence numbers in sorted (including holes) */
+	int *pending; /* sequence numbers of the items added since sorted was last merged (from the oldest to the latest) */
+	int pendinglen; /* number of sequence numbers in pending */
+	int pendingsize; /* allocated size of pending */
+
+	char *prefix; /* line being browsed from, when only the items starting with it are browsed (NULL otherwise) */
+	int prefixlen; /* length of prefix */
+
+	struct _raw_buf *suggestline; /* line the suggestion candidates were narrowed down for (empty if they have to be found again) */
+	int suggestlo; /* first position in sorted of the items which are longer than suggestline and start with it */
+	int suggesthi; /* position in sorted after the last of those items */
+	int *suggestnew; /* sequence numbers in pending of the items which are longer than suggestline and start with it (latest first) */
+	int suggestnewlen; /* number of sequence numbers in suggestnew */
+	int suggestseq; /* sequence number of the item suggested for suggestline (-1 if there isn't one) */
+
+	int len; /* size of history (including erased items) */
 	int max; /* maximum size of history */
+	int count; /* sequence number of the next item added to history (the latest item is in slot (count - 1) % max) */
 	int index; /* history index of current line (-1 if line not in history) */
 };
 
+struct _raw_journal {
+	char *path; /* path of the journal (needed to compact it) */
+	int fd; /* journal file descriptor (opened with O_APPEND) */
+	off_t offset; /* how much of the journal has been read into the history */
+
+	int sync; /* fsync(2) the journal after this many items (0 leaves it to the kernel) */
+	int unsynced; /* number of items appended since the last fsync(2) */
+
+	off_t *own; /* where the items appended by this instance start, for those which haven't been read yet */
+	int ownlen; /* number of offsets in own */
+	int ownsize; /* allocated number of offsets in own */
+};
+
 struct _raw_comp {
 	char **(*callback)(char *input); /* a callback function to fill a search table for completion */
 	void (*cleanup)(char **table); /* optional cleanup function to free memory given from output of callback() */
+
+	char **cache; /* candidates from the last call of callback(), narrowed down to cachekey (NULL if nothing is cached) */
+	int cachelen; /* number of candidates in cache */
+	char *cachekey; /* input the candidates in cache start with */
+	time_t cachetime; /* when callback() gave the cached candidates */
+	int ttl; /* how long candidates are cached for, in seconds (0 if they don't expire) */
+
+	char **corpus; /* registered corpus, sorted (NULL if there isn't one) */
+	int corpuslen; /* number of items in corpus */
+	char *corpusbuf; /* the items of corpus, one after the other */
+
+	void (*stream)(struct raw_t *raw, char *input); /* a callback function to emit candidates one at a time with raw_comp_emit() */
+	bool emitting; /* is stream() being called? */
+	char *emitinput; /* input given to stream() */
+	int emitinputlen; /* length of emitinput */
+	char *emitprefix; /* first candidate so far (NULL if there isn't one), of which the first emitlen bytes are common to every candidate */
+	int emitlen; /* length of the common prefix of the candidates so far */
+	char *emitbuf; /* copy of the first candidate emitted (if it came from stream()) */
+	int emitsize; /* allocated size of emitbuf */
+
+	struct _raw_provider *providers; /* providers of candidates, run on the worker pool (NULL if there aren't any) */
+	int nproviders; /* number of providers */
+	struct _raw_pool *pool; /* worker pool for the providers (NULL if they are run on the input thread) */
+	struct _raw_req *async; /* asynchronous request waiting for the providers (NULL if there isn't one) */
+};
+
+struct _raw_provider {
+	char **(*callback)(char *input); /* fills a search table (like _raw_comp.callback) */
+	void (*cleanup)(char **table); /* optional cleanup function to free the search table */
+};
+
+/* A tab press asks every provider for its candidates. The request is shared by the jobs for each provider, and is
+ * freed by whoever is done with it last (the input thread, or the last job to finish once the deadline has passed). */
+struct _raw_req {
+	char *input; /* copy of the input given to the providers */
+	int len; /* length of input */
+	int pending; /* number of providers which haven't finished yet */
+	bool abandoned; /* has the input thread stopped waiting for the providers? */
+	bool async; /* is the input thread woken up (through the pool's wake pipe) once the request is ready? */
+	struct timespec deadline; /* when the input thread stops waiting for the providers */
+	char *prefix; /* first candidate so far (NULL if there isn't one), of which the first complen bytes are common to every candidate */
+	int complen; /* length of the common prefix of the candidates so far */
+};
+
+struct _raw_job {
+	struct _raw_req *req; /* the request this job is part of */
+	struct _raw_provider provider; /* the provider to call */
+	struct _raw_job *next; /* next job in the queue */
+};
+
+struct _raw_pool {
+	int nthreads; /* number of worker threads which haven't exited yet (they are detached, so nothing waits for them) */
+	int deadline; /* how long a tab press waits for the providers, in milliseconds (0 if it waits for all of them) */
+
+	pthread_mutex_t lock; /* protects everything below (and every request) */
+	pthread_cond_t work; /* signalled when a job is queued, or the pool is stopped */
+	pthread_cond_t done; /* signalled when a job is finished */
+	struct _raw_job *head, *tail; /* queue of jobs */
+	bool stop; /* are the workers being stopped (after which the last worker to exit frees the pool)? */
+
+	int wake[2]; /* pipe written to when an asynchronous request is ready */
 };
 
 struct _raw_set {
 	bool history; /* is history enabled? */
-	bool completion; /* is completion enabled? */
+	bool completion; /* is completion enabled (with a callback, a corpus, a stream or any of them together)? */
+	bool erasedups; /* are older duplicates erased from history? */
+	bool prefix; /* does browsing the history only go through items starting with the line? */
+	bool suggest; /* are history items suggested while typing? */
+	bool frecency; /* are history items ranked by how often and how recently they were used? */
+	bool compcache; /* are completion candidates cached between tab presses? */
+	bool comppool; /* are completion providers run on a worker pool? */
+	bool compasync; /* does the input thread keep handling keys while the providers run? */
+};
+
+/* Internal Error Types (these are also what key binding callbacks return) */
+enum {
+	SUCCESS = RAW_SUCCESS, /* no errors to report */
+	SILENT = RAW_SILENT, /* ignorable error */
+	BELL = RAW_BELL, /* ring the terminal bell. */
+	ENTER = RAW_ENTER, /* not an error, the line is finished */
+	ABORT = RAW_ABORT /* not an error, the line was aborted */
+};
+
+/* Keys used internally by the key decoder, which can't be bound. */
+enum {
+	RAW_KEY_NONE = -1, /* no key could be read */
+	RAW_KEY_PASTE = RAW_KEY_MAX, /* a bracketed paste (the text is in raw->keys->paste) */
+	RAW_KEY_COMPLETE, /* the providers of an asynchronous completion are done */
+	RAW_KEY_PASTE_START /* the start of a bracketed paste */
 };
 
-/* Internal Error Types */
+/* Key decoder states. */
 enum {
-	SUCCESS, /* no errors to report */
-	SILENT, /* ignorable error */
-	BELL /* ring the terminal bell. */
+	DEC_NONE, /* not in an escape sequence */
+	DEC_SEQ, /* in an escape sequence, walking the trie */
+	DEC_SKIP, /* skipping the rest of an unknown CSI sequence */
+	DEC_PASTE /* in a bracketed paste, waiting for the end marker */
 };
 
 /* Static functions only used internally. These functions are never exposed outside of the library,
@@ -118,11 +372,118 @@ static int _raw_strnchr(char *str, char ch) {
 	return ret;
 } /* _raw_strnchr() */
 
-static void _raw_error(int err) {
+/* Output to the terminal is never done through stdio. Everything is appended to a per-instance output buffer,
+ * and each frame is sent to the terminal with a single write(2). This keeps a redraw down to one syscall (and
+ * one packet, if the terminal is remote). */
+
+static struct _raw_buf *_raw_buf_new(int size) {
+	struct _raw_buf *buf = _raw_malloc(sizeof(struct _raw_buf));
+
+	buf->size = size;
+	buf->len = 0;
+	buf->buf = _raw_malloc(buf->size);
+
+	return buf;
+} /* _raw_buf_new() */
+
+static void _raw_buf_free(struct _raw_buf *buf) {
+	free(buf->buf);
+	free(buf);
+} /* _raw_buf_free() */
+
+static void _raw_buf_add(struct _raw_buf *buf, char *str, int len) {
+	/* grow the buffer geometrically */
+	if(buf->len + len > buf->size) {
+		while(buf->len + len > buf->size)
+			buf->size *= 2;
+
+		buf->buf = _raw_realloc(buf->buf, buf->size);
+	}
+
+	memcpy(buf->buf + buf->len, str, len);
+	buf->len += len;
+} /* _raw_buf_add() */
+
+static void _raw_out_str(struct raw_t *raw, char *str) {
+	_raw_buf_add(raw->term->out, str, strlen(str));
+} /* _raw_out_str() */
+
+static void _raw_out_csi(struct raw_t *raw, int arg, char code) {
+	char seq[16];
+	int len = sizeof(seq);
+
+	/* format the sequence backwards, from the final byte to the CSI */
+	seq[--len] = code;
+	do {
+		seq[--len] = '0' + arg % 10;
+		arg /= 10;
+	} while(arg);
+
+	seq[--len] = '[';
+	seq[--len] = '\x1b';
+
+	_raw_buf_add(raw->term->out, seq + len, sizeof(seq) - len);
+} /* _raw_out_csi() */
+
+static void _raw_out_flush(struct raw_t *raw) {
+	struct _raw_buf *out = raw->term->out;
+	int done = 0;
+
+	/* write the entire frame, only retrying if the write was cut short */
+	while(done < out->len) {
+		int ret = write(raw->term->ofd, out->buf + done, out->len - done);
+
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+
+		done += ret;
+	}
+
+	out->len = 0;
+} /* _raw_out_flush() */
+
+/* Columns are counted per character, so the bytes after the first byte of a UTF-8 character don't take up any. */
+#define _raw_utf8_cont(ch) (((unsigned char) (ch) & 0xC0) == 0x80)
+
+static int _raw_strwidth(char *str) {
+	int width = 0;
+
+	/* count the columns taken up by a string, ignoring control characters, escape
+	 * sequences (such as colours in a prompt) and UTF-8 continuation bytes */
+	while(*str) {
+		unsigned char ch = *str++;
+
+		if(ch == 27 && *str == '[') {
+			/* skip to the final byte of the sequence */
+			for(str++; *str && (*str < 64 || *str > 126); str++);
+			if(*str)
+				str++;
+		}
+		else if(ch > 31 && ch != 127 && !_raw_utf8_cont(ch))
+			width++;
+	}
+
+	return width;
+} /* _raw_strwidth() */
+
+static int _raw_cols(char *str, int len) {
+	int i, cols = 0;
+
+	/* count the columns taken up by text in the line (control characters are shown as a '?', so they take one) */
+	for(i = 0; i < len; i++)
+		if(!_raw_utf8_cont(str[i]))
+			cols++;
+
+	return cols;
+} /* _raw_cols() */
+
+static void _raw_error(struct raw_t *raw, int err) {
 	switch(err) {
 		case BELL:
-			fprintf(stderr, C_BELL);
-			fflush(stderr);
+			_raw_out_str(raw, C_BELL);
 		case SUCCESS:
 		case SILENT:
 		default:
@@ -130,6 +491,31 @@ static void _raw_error(int err) {
 	}
 } /* _raw_error() */
 
+/* The width of the terminal is only queried when a new line is started, and when the terminal is resized. The
+ * signal handler just bumps a counter, and each instance notices the change the next time it redraws. */
+
+static volatile sig_atomic_t _raw_winch = 0;
+static struct sigaction _raw_oldwinch;
+
+static void _raw_winch_handler(int sig) {
+	_raw_winch++;
+
+	/* don't steal SIGWINCH from the application */
+	if(!(_raw_oldwinch.sa_flags & SA_SIGINFO) && _raw_oldwinch.sa_handler != SIG_DFL && _raw_oldwinch.sa_handler != SIG_IGN)
+		_raw_oldwinch.sa_handler(sig);
+} /* _raw_winch_handler() */
+
+static void _raw_term_size(struct raw_t *raw) {
+	struct winsize size;
+
+	raw->term->winch = _raw_winch;
+	raw->term->cols = 80;
+
+	/* fall back to 80 columns if the terminal doesn't know its size */
+	if(ioctl(raw->term->ofd, TIOCGWINSZ, &size) >= 0 && size.ws_col > 0)
+		raw->term->cols = size.ws_col;
+} /* _raw_term_size() */
+
 /* Raw mode is a mode where the terminal will give EVERY character with 0 timeout, no buffering and no
  * console output. It also disables signal characters, the conversion of characters or output control.
  * Essentially, undo all of the hard work of terminal developers and send the terminal back in time,
@@ -160,410 +546,3796 @@ static void _raw_mode(struct raw_t *raw, bool state) {
 		new.c_cc[VTIME] = 0; /* don't wait */
 	}
 
+	/* (un)hook SIGWINCH, which is only needed while a line is being edited */
+	if(state && !raw->term->mode) {
+		struct sigaction winch;
+
+		memset(&winch, 0, sizeof(winch));
+		sigemptyset(&winch.sa_mask);
+		winch.sa_handler = _raw_winch_handler;
+
+		/* no SA_RESTART, so that a resize interrupts read(2) and gets redrawn straight away */
+		sigaction(SIGWINCH, &winch, &_raw_oldwinch);
+	}
+	else if(!state && raw->term->mode) {
+		sigaction(SIGWINCH, &_raw_oldwinch, NULL);
+	}
+
 	/* set new settings and flush out terminal */
 	tcsetattr(0, TCSAFLUSH, &new);
 	raw->term->mode = state;
+
+	/* pastes are only bracketed while we're reading input */
+	_raw_out_str(raw, state ? C_PASTE_ON : C_PASTE_OFF);
+	_raw_out_flush(raw);
 } /* _raw_mode() */
 
-/* == Line Editing == */
+/* == Key Decoding == */
 
-static int _raw_del_char(struct raw_t *raw) {
-	assert(raw->safe, "raw_t structure not allocated");
+/* Input is read from the terminal in large chunks, rather than a byte at a time, and then decoded into keys. The
+ * decoder is a state machine which keeps its state between calls, so an escape sequence which is split between
+ * two reads is still decoded correctly.
+ *
+ * Escape sequences are looked up in a trie (one per instance, since applications can add their own sequences),
+ * which is walked one byte at a time as the sequence arrives. Decoding a sequence is therefore proportional to
+ * its length, no matter how many sequences are known. */
+
+#define _RAW_IN_SIZE 4096
+#define _RAW_ESC_TIMEOUT 50
+
+/* Escape sequences known by default (without the leading ESC). */
+static struct {
+	char *seq;
+	int key;
+} _raw_seqs[] = {
+	{"[A", RAW_KEY_UP},
+	{"[B", RAW_KEY_DOWN},
+	{"[C", RAW_KEY_RIGHT},
+	{"[D", RAW_KEY_LEFT},
+	{"[H", RAW_KEY_HOME},
+	{"[F", RAW_KEY_END},
+	{"OA", RAW_KEY_UP},
+	{"OB", RAW_KEY_DOWN},
+	{"OC", RAW_KEY_RIGHT},
+	{"OD", RAW_KEY_LEFT},
+	{"OH", RAW_KEY_HOME},
+	{"OF", RAW_KEY_END},
+	{"[1~", RAW_KEY_HOME},
+	{"[2~", RAW_KEY_INSERT},
+	{"[3~", RAW_KEY_DELETE},
+	{"[4~", RAW_KEY_END},
+	{"[5~", RAW_KEY_PGUP},
+	{"[6~", RAW_KEY_PGDN},
+	{"[7~", RAW_KEY_HOME},
+	{"[8~", RAW_KEY_END},
+	{"[1;5C", RAW_KEY_CTRL_RIGHT},
+	{"[1;5D", RAW_KEY_CTRL_LEFT},
+	{"[5C", RAW_KEY_CTRL_RIGHT},
+	{"[5D", RAW_KEY_CTRL_LEFT},
+	{"Oc", RAW_KEY_CTRL_RIGHT},
+	{"Od", RAW_KEY_CTRL_LEFT},
+	{"[200~", RAW_KEY_PASTE_START},
+	{NULL, 0}
+};
 
-	/* if you try to delete the end of the line, move
-	 * the cursor back one character of input */
-	if(raw->line->cursor >= raw->line->line->len && raw->line->cursor > 0)
-		raw->line->cursor--;
+static int _raw_trie_child(struct _raw_keys *keys, int node, unsigned char ch) {
+	int child;
 
-	/* deletion is invalid if there is no input string
-	 * or the cursor is past the end of the input */
-	if(!raw->line->line->len || raw->line->cursor >= raw->line->line->len)
-		return BELL;
+	/* find the child of the node for the next byte of the sequence */
+	for(child = keys->trie[node].child; child; child = keys->trie[child].next)
+		if(keys->trie[child].ch == ch)
+			return child;
 
-	/* update len and make shorthand variables */
-	raw->line->line->len--;
-	int cur = raw->line->cursor, len = raw->line->line->len;
+	return 0;
+} /* _raw_trie_child() */
 
-	/* create a copy of the string */
-	char *cpy = _raw_malloc(len + 1);
+static void _raw_trie_add(struct _raw_keys *keys, char *seq, int key) {
+	int node = 0;
 
-	/* delete char */
-	memcpy(cpy, raw->line->line->str, cur); /* copy before cursor */
-	memcpy(cpy + cur, raw->line->line->str + cur + 1, len - cur); /* copy after cursor */
-	cpy[len] = '\0';
+	for(; *seq; seq++) {
+		int child = _raw_trie_child(keys, node, *seq);
 
-	/* copy over copy to correct line */
-	raw->line->line->str = _raw_realloc(raw->line->line->str, len + 1);
-	memcpy(raw->line->line->str, cpy, len + 1);
-	free(cpy);
+		/* add a new child node for this byte */
+		if(!child) {
+			if(keys->trielen >= keys->triesize) {
+				keys->triesize *= 2;
+				keys->trie = _raw_realloc(keys->trie, keys->triesize * sizeof(struct _raw_trie));
+			}
 
-	if(raw->line->cursor > raw->line->line->len)
-		raw->line->cursor = raw->line->line->len;
+			child = keys->trielen++;
+			keys->trie[child].ch = *seq;
+			keys->trie[child].key = RAW_KEY_NONE;
+			keys->trie[child].child = 0;
+			keys->trie[child].next = keys->trie[node].child;
+			keys->trie[node].child = child;
+		}
 
-	return SUCCESS;
-} /* _raw_del_char() */
+		node = child;
+	}
 
-static int _raw_backspace(struct raw_t *raw) {
-	assert(raw->safe, "raw_t structure not allocated");
+	keys->trie[node].key = key;
+} /* _raw_trie_add() */
 
-	/* backspace is invalid if there is no input
-	 * or the cursor is at the start of the string */
-	if(!raw->line->line->len || raw->line->cursor < 1)
-		return BELL;
+static int _raw_key_feed(struct raw_t *raw, unsigned char ch) {
+	struct _raw_keys *keys = raw->keys;
 
-	/* move cursor one to the left and do a delete */
-	raw->line->cursor--;
-	return _raw_del_char(raw);
-} /* _raw_backspace() */
+	switch(keys->state) {
+		case DEC_NONE:
+			if(ch != 27)
+				return ch;
 
-#define _raw_delete(raw) _raw_del_char(raw)
+			keys->state = DEC_SEQ;
+			keys->node = 0;
+			break;
+		case DEC_SEQ:
+			{
+				/* ESC ESC is a lone escape, followed by another sequence */
+				if(!keys->node && ch == 27)
+					return RAW_KEY_ESC;
+
+				int child = _raw_trie_child(keys, keys->node, ch);
+
+				if(!keys->node)
+					keys->csi = ch == '[';
+
+				/* unknown sequence */
+				if(!child) {
+					/* the rest of an unknown CSI sequence (up to its final byte) has to be skipped */
+					if(keys->csi && keys->node && ch > 31 && ch < 64) {
+						keys->state = DEC_SKIP;
+						break;
+					}
 
-static int _raw_add_char(struct raw_t *raw, char ch) {
-	assert(raw->safe, "raw_t structure not allocated");
+					keys->state = DEC_NONE;
+					return RAW_KEY_UNKNOWN;
+				}
 
-	/* update len and make shorthand variables */
-	raw->line->line->len++;
-	int cur = raw->line->cursor, len = raw->line->line->len;
+				keys->node = child;
+				if(keys->trie[child].key == RAW_KEY_NONE)
+					break;
 
-	/* create a copy of the string */
-	char *cpy = _raw_malloc(len + 1);
+				keys->state = DEC_NONE;
 
-	/* add char */
-	memcpy(cpy, raw->line->line->str, cur); /* copy before cursor */
-	cpy[cur] = ch;
+				/* start of a bracketed paste */
+				if(keys->trie[child].key == RAW_KEY_PASTE_START) {
+					keys->state = DEC_PASTE;
+					keys->pastematch = 0;
+					keys->paste->len = 0;
+					break;
+				}
 
-	memcpy(cpy + cur + 1, raw->line->line->str + cur, len - cur - 1); /* copy after cursor */
-	cpy[len] = '\0';
+				return keys->trie[child].key;
+			}
+		case DEC_SKIP:
+			/* skip parameter and intermediate bytes, up to the final byte */
+			if(ch > 63 && ch < 127) {
+				keys->state = DEC_NONE;
+				return RAW_KEY_UNKNOWN;
+			}
+			break;
+		case DEC_PASTE:
+			/* everything is literal text until the end marker */
+			if(ch == C_PASTE_END[keys->pastematch]) {
+				if(++keys->pastematch < (int) strlen(C_PASTE_END))
+					break;
 
-	/* copy over copy to correct line */
-	raw->line->line->str = _raw_realloc(raw->line->line->str, len + 1);
-	memcpy(raw->line->line->str, cpy, len + 1);
-	free(cpy);
+				keys->state = DEC_NONE;
+				return RAW_KEY_PASTE;
+			}
 
-	/* update cursor */
-	raw->line->cursor++;
-	return SUCCESS;
-} /* _raw_add_char() */
+			/* it wasn't the end marker after all */
+			_raw_buf_add(keys->paste, C_PASTE_END, keys->pastematch);
+			keys->pastematch = 0;
 
-#define _raw_insert(raw, ch) _raw_add_char(raw, ch)
+			if(ch == C_PASTE_END[0])
+				keys->pastematch = 1;
+			else
+				_raw_buf_add(keys->paste, (char *) &ch, 1);
+			break;
+	}
 
-static int _raw_move_cur(struct raw_t *raw, int offset) {
-	assert(raw->safe, "raw_t structure not allocated");
+	/* need more bytes */
+	return RAW_KEY_NONE;
+} /* _raw_key_feed() */
 
-	int new_cursor = raw->line->cursor + offset;
+static bool _raw_key_wait(struct raw_t *raw, int timeout) {
+	struct pollfd fd;
 
-	/* movement is invalid if cursor position would be before string
-	 * or more than one past the end of the string. */
-	if(new_cursor < 0 || new_cursor > raw->line->line->len)
-		return SILENT;
+	/* check if the terminal has input for us, waiting for at most timeout ms */
+	fd.fd = raw->term->fd;
+	fd.events = POLLIN;
+	fd.revents = 0;
 
-	raw->line->cursor += offset;
-	return SUCCESS;
-} /* _raw_move_cur() */
+	return poll(&fd, 1, timeout) > 0 && (fd.revents & POLLIN);
+} /* _raw_key_wait() */
 
-#define _raw_left(raw) _raw_move_cur(raw, -1)
-#define _raw_right(raw) _raw_move_cur(raw, 1)
+static int _raw_comp_wait(struct raw_t *raw);
 
-static void _raw_redraw(struct raw_t *raw, bool change) {
-	assert(raw->safe, "raw_t structure not allocated");
+static int _raw_key_get(struct raw_t *raw) {
+	struct _raw_keys *keys = raw->keys;
+	struct _raw_buf *in = raw->term->in;
 
-	/* move to after the prompt */
-	if(raw->line->oldcursor)
-		printf(C_CUR_MOVE_BACK, raw->line->oldcursor);
+	while(true) {
+		/* decode whatever is left in the input buffer */
+		while(raw->term->inpos < in->len) {
+			/* copy pasted text up to the next possible end marker in one go */
+			if(keys->state == DEC_PASTE && !keys->pastematch) {
+				char *start = in->buf + raw->term->inpos;
+				char *end = memchr(start, 27, in->len - raw->term->inpos);
 
-	/* redraw input string */
-	if(change) {
-		printf(C_LN_CLEAR_END);
-		printf("%s", raw->line->line->str);
+				if(!end)
+					end = in->buf + in->len;
 
-		if(raw->line->line->len)
-			printf(C_CUR_MOVE_BACK, raw->line->line->len);
-	}
+				_raw_buf_add(keys->paste, start, end - start);
+				raw->term->inpos += end - start;
 
-	/* update the cursor position */
-	if(raw->line->cursor)
-		printf(C_CUR_MOVE_FORWARD, raw->line->cursor);
+				if(raw->term->inpos >= in->len)
+					break;
+			}
 
-	/* commit changes to tty */
-	fflush(stdout);
-} /* _raw_redraw() */
+			int key = _raw_key_feed(raw, in->buf[raw->term->inpos++]);
+			if(key != RAW_KEY_NONE)
+				return key;
+		}
 
-/* == History == */
+		/* If all we have is an ESC, it could be the start of a sequence or the escape key. Terminals send sequences
+		 * all at once, so if nothing else arrives before the timeout it was the escape key. */
+		if(keys->state == DEC_SEQ && !keys->node) {
+			errno = 0;
 
-static struct _raw_hist *_raw_hist_new(int size) {
-	struct _raw_hist *hist = _raw_malloc(sizeof(struct _raw_hist));
+			if(!_raw_key_wait(raw, keys->timeout)) {
+				/* the wait was interrupted (by a resize, most likely) */
+				if(errno == EINTR)
+					return RAW_KEY_NONE;
 
-	hist->max = size + 1;
-	hist->len = 0;
-	hist->index = -1;
+				keys->state = DEC_NONE;
+				return RAW_KEY_ESC;
+			}
+		}
 
-	hist->history = _raw_malloc(sizeof(char *) * hist->max);
-	memset(hist->history, 0, sizeof(char *) * hist->max);
+		/* while an asynchronous completion is outstanding, wait for its providers as well as the terminal */
+		if(raw->comp && raw->comp->async) {
+			int ready = _raw_comp_wait(raw);
 
-	hist->buffer = NULL;
-	hist->original = NULL;
+			if(ready < 0)
+				return RAW_KEY_NONE;
+			if(ready)
+				return RAW_KEY_COMPLETE;
+		}
 
-	return hist;
-} /* _raw_hist_new() */
+		/* refill the input buffer, getting as much input as is available */
+		int len = read(raw->term->fd, in->buf, in->size);
 
-static void _raw_set_line(struct raw_t *raw, char *str, int cursor) {
-	assert(raw->safe, "raw_t structure not allocated");
+		if(len < 0)
+			return RAW_KEY_NONE;
 
-	int len = strlen(str);
+		/* the terminal has gone away, so act like ctrl-d */
+		if(!len)
+			return 4;
 
-	/* copy over the string to line */
-	raw->line->line->str = _raw_realloc(raw->line->line->str, len + 1);
-	memcpy(raw->line->line->str, str, len);
-	raw->line->line->str[len] = '\0';
+		in->len = len;
+		raw->term->inpos = 0;
+	}
+} /* _raw_key_get() */
 
-	/* update len and cursor */
-	raw->line->line->len = len;
-	raw->line->cursor = cursor;
+static bool _raw_key_pending(struct raw_t *raw) {
+	/* there are still bytes in the input buffer, or the terminal has more input for us */
+	return raw->term->inpos < raw->term->in->len || _raw_key_wait(raw, 0);
+} /* _raw_key_pending() */
 
-	/* if the given cursor position is illogical, move it to start */
-	if(raw->line->cursor < 0 || raw->line->cursor > len)
-		raw->line->cursor = 0;
-} /* _raw_set_line() */
+/* == Gap Buffer == */
 
-static void _raw_hist_free(struct _raw_hist *hist) {
-	int i;
-	for(i = 0; i < hist->max; i++)
-		free(hist->history[i]);
-	free(hist->history);
+/* The input line is stored as a gap buffer. All of the free space in the buffer is kept as a single "gap", which
+ * is moved to wherever an edit happens. Since edits almost always happen at the cursor, moving the gap is usually
+ * free, and inserting or deleting a character is just a matter of resizing the gap. The gap is never allowed to be
+ * empty, so that there is always space to null terminate the text when a contiguous string is needed. */
 
-	free(hist->buffer);
-	free(hist->original);
+#define _RAW_GAP_MIN 64
 
-	hist->len = 0;
-	hist->max = 0;
-} /* _raw_hist_free() */
+static struct _raw_gap *_raw_gap_new(void) {
+	struct _raw_gap *gap = _raw_malloc(sizeof(struct _raw_gap));
 
-static void _raw_hist_add_str(struct raw_t *raw, char *str) {
-	assert(raw->safe, "raw_t structure not allocated");
-	assert(raw->settings->history, "raw_t history not enabled");
+	gap->size = _RAW_GAP_MIN;
+	gap->buf = _raw_malloc(gap->size);
 
-	int index = 0;
-	if(raw->hist->index > -1)
-		index = raw->hist->index;
+	gap->start = 0;
+	gap->end = gap->size;
+	gap->len = 0;
 
-	/* do not add duplicate consecutive entries in history */
-	if(index < raw->hist->len && !strcmp(raw->hist->history[index], str))
-		return;
+	return gap;
+} /* _raw_gap_new() */
 
-	/* memmove(3) is magical */
-	if(raw->hist->index < 0) {
-		/* free the last item in the history (if the history is full) */
-		if(raw->hist->len >= raw->hist->max)
-			free(raw->hist->history[raw->hist->max - 1]);
+static void _raw_gap_free(struct _raw_gap *gap) {
+	free(gap->buf);
+	free(gap);
+} /* _raw_gap_free() */
 
-		/* memmove(3) the entire history */
-		memmove(raw->hist->history + 1, raw->hist->history, sizeof(char *) * (raw->hist->max - 1));
-		raw->hist->index = 0;
+static void _raw_gap_move(struct _raw_gap *gap, int pos) {
+	assert(pos >= 0 && pos <= gap->len, "gap position out of bounds");
 
-		/* update length */
-		raw->hist->len++;
-		if(raw->hist->len > raw->hist->max)
-			raw->hist->len = raw->hist->max;
+	/* move the text between the new and old gap positions to the other side of the gap */
+	if(pos < gap->start) {
+		int count = gap->start - pos;
+		memmove(gap->buf + gap->end - count, gap->buf + pos, count);
 
-		raw->hist->history[0] = NULL;
+		gap->start -= count;
+		gap->end -= count;
 	}
+	else if(pos > gap->start) {
+		int count = pos - gap->start;
+		memmove(gap->buf + gap->start, gap->buf + gap->end, count);
 
-	/* modify (or add) history item */
-	if(raw->hist->index > -1)
-		free(raw->hist->history[raw->hist->index]);
+		gap->start += count;
+		gap->end += count;
+	}
+} /* _raw_gap_move() */
 
-	raw->hist->history[raw->hist->index] = _raw_strdup(str);
-} /* _raw_hist_add_str() */
+static void _raw_gap_grow(struct _raw_gap *gap, int need) {
+	/* the gap must still hold at least one byte after inserting, for the null terminator */
+	if(gap->end - gap->start > need)
+		return;
 
-#define _RAW_HIST_PREV 1
-#define _RAW_HIST_NEXT -1
+	int size = gap->size, after = gap->size - gap->end;
+	while(size - gap->len <= need)
+		size *= 2;
 
-static int _raw_hist_move(struct raw_t *raw, int move) {
-	assert(raw->safe, "raw_t structure not allocated");
-	assert(raw->settings->history, "raw_t history not enabled");
+	/* grow the buffer and shift the text after the gap to the end of it */
+	gap->buf = _raw_realloc(gap->buf, size);
+	memmove(gap->buf + size - after, gap->buf + gap->end, after);
 
-	/* movement is invalid if movement will be "out of bounds" on the array */
-	if(raw->hist->index + move < -1 || raw->hist->index + move >= raw->hist->len)
-		return BELL;
+	gap->end = size - after;
+	gap->size = size;
+} /* _raw_gap_grow() */
 
-	/* copy over the line before getting the history */
-	if(raw->hist->index < 0) {
-		free(raw->hist->original);
-		raw->hist->original = _raw_strdup(raw->line->line->str);
-	}
+static void _raw_gap_insert(struct _raw_gap *gap, int pos, char *str, int len) {
+	_raw_gap_grow(gap, len);
+	_raw_gap_move(gap, pos);
 
-	/* free current line data */
-	free(raw->line->line->str);
-	raw->hist->index += move;
+	memcpy(gap->buf + gap->start, str, len);
+	gap->start += len;
+	gap->len += len;
+} /* _raw_gap_insert() */
 
-	if(raw->hist->index < 0)
-		/* get original line */
-		raw->line->line->str = _raw_strdup(raw->hist->original);
-	else
-		/* move position and copy over the history entry */
-		raw->line->line->str = _raw_strdup(raw->hist->history[raw->hist->index]);
+static void _raw_gap_delete(struct _raw_gap *gap, int pos, int len) {
+	assert(pos + len <= gap->len, "gap deletion out of bounds");
 
-	raw->line->line->len = strlen(raw->line->line->str);
-	return SUCCESS;
-} /* _raw_hist_move() */
+	/* deleting text just widens the gap */
+	_raw_gap_move(gap, pos);
+	gap->end += len;
+	gap->len -= len;
+} /* _raw_gap_delete() */
 
-static char *_raw_hist_to_serial(struct raw_t *raw) {
-	char *ret = NULL;
+static void _raw_gap_set(struct _raw_gap *gap, char *str, int len) {
+	/* throw away the old text and insert the new text */
+	gap->start = 0;
+	gap->end = gap->size;
+	gap->len = 0;
 
-	int i, len = 0, itemlen = 0;
-	for(i = 0; i < raw->hist->len; i++) {
-		itemlen = strlen(raw->hist->history[i]) + 1;
+	_raw_gap_insert(gap, 0, str, len);
+} /* _raw_gap_set() */
 
-		ret = _raw_realloc(ret, len + itemlen);
-		memcpy(ret + len, raw->hist->history[i], itemlen);
+static int _raw_gap_prefix(struct _raw_gap *gap, char *str, int len) {
+	int i = 0;
 
-		len += itemlen;
-		ret[len - 1] = '\n'; /* the seperator */
-	}
+	/* find the length of the common prefix, on both sides of the gap */
+	while(i < gap->start && i < len && gap->buf[i] == str[i])
+		i++;
 
-	if(!ret)
-		return NULL;
+	if(i == gap->start)
+		while(i < gap->len && i < len && gap->buf[gap->end + i - gap->start] == str[i])
+			i++;
 
-	/* null terminate string */
-	ret[len - 1] = '\0';
-	return ret;
-} /* _raw_hist_to_serial() */
+	return i;
+} /* _raw_gap_prefix() */
 
-static int _raw_hist_from_serial(struct raw_t *raw, char *str) {
-	/* no string given */
-	if(!str)
-		return -1;
+static char _raw_gap_at(struct _raw_gap *gap, int pos) {
+	/* get the character at the given position, on either side of the gap */
+	return pos < gap->start ? gap->buf[pos] : gap->buf[gap->end + pos - gap->start];
+} /* _raw_gap_at() */
 
-	/* eradicate the old history. */
-	int max = raw->hist->max - 1;
-	_raw_hist_free(raw->hist);
-	free(raw->hist);
+static int _raw_gap_cols(struct _raw_gap *gap, int from, int to) {
+	int cols = 0;
 
-	/* get length of serialised history */
-	int len = _raw_strnchr(str, '\n');
+	/* count the columns taken up by the text between two positions, on both sides of the gap */
+	if(from < gap->start) {
+		int end = to < gap->start ? to : gap->start;
+		cols += _raw_cols(gap->buf + from, end - from);
+		from = end;
+	}
 
-	/* length is upper limit */
-	if(len > max)
-		max = len;
+	if(from < to)
+		cols += _raw_cols(gap->buf + gap->end + from - gap->start, to - from);
 
-	/* make a new history */
-	raw->hist = _raw_hist_new(max);
+	return cols;
+} /* _raw_gap_cols() */
 
-	/* fill up the history with the tokens */
-	str = _raw_strdup(str);
-	char *tok = strtok(str, "\n");
+static int _raw_gap_pos(struct _raw_gap *gap, int cols) {
+	int pos = 0;
 
-	if(tok) {
-		do {
-			raw->hist->index = -1;
-			_raw_hist_add_str(raw, tok);
-		} while((tok = strtok(NULL, "\n")) != NULL);
+	/* find the position of the character drawn at the given column (the end of the text if it's past it) */
+	while(pos < gap->len) {
+		if(!_raw_utf8_cont(_raw_gap_at(gap, pos)) && !cols--)
+			break;
+		pos++;
 	}
 
-	free(str);
-	return 0;
-} /* _raw_hist_from_serial() */
+	return pos;
+} /* _raw_gap_pos() */
 
-/* == Completion == */
+static char *_raw_gap_str(struct _raw_gap *gap) {
+	/* move the gap to the end, so the text is contiguous and can be null terminated */
+	_raw_gap_move(gap, gap->len);
+	gap->buf[gap->len] = '\0';
 
-static char **_raw_comp_filter(struct raw_t *raw, char *str) {
-	assert(raw->safe, "raw_t structure not allocated");
+	return gap->buf;
+} /* _raw_gap_str() */
+
+/* == Line Editing == */
+
+/* Every edit marks the first position of the line it changed. The redraw only needs to repaint the line
+ * from that position onwards, since everything before it is already correct on the terminal. */
+
+static void _raw_dirty(struct raw_t *raw, int pos) {
+	if(raw->line->dirty < 0 || pos < raw->line->dirty)
+		raw->line->dirty = pos;
+
+	raw->line->changed = true;
+} /* _raw_dirty() */
+
+static int _raw_move_cur(struct raw_t *raw, int offset) {
+	assert(raw->safe, "raw_t structure not allocated");
+
+	int new_cursor = raw->line->cursor + offset;
+
+	/* movement is invalid if cursor position would be before string
+	 * or more than one past the end of the string. */
+	if(new_cursor < 0 || new_cursor > raw->line->line->len)
+		return SILENT;
+
+	/* the cursor never ends up in the middle of a UTF-8 character */
+	while(new_cursor > 0 && new_cursor < raw->line->line->len && _raw_utf8_cont(_raw_gap_at(raw->line->line, new_cursor)))
+		new_cursor += offset;
+
+	raw->line->cursor = new_cursor;
+	return SUCCESS;
+} /* _raw_move_cur() */
+
+#define _raw_left(raw) _raw_move_cur(raw, -1)
+#define _raw_right(raw) _raw_move_cur(raw, 1)
+
+static int _raw_del_char(struct raw_t *raw) {
+	assert(raw->safe, "raw_t structure not allocated");
+
+	/* if you try to delete the end of the line, move
+	 * the cursor back one character of input */
+	if(raw->line->cursor >= raw->line->line->len && raw->line->cursor > 0)
+		_raw_move_cur(raw, -1);
+
+	/* deletion is invalid if there is no input string
+	 * or the cursor is past the end of the input */
+	if(!raw->line->line->len || raw->line->cursor >= raw->line->line->len)
+		return BELL;
+
+	/* delete char (all of its bytes, if it's UTF-8) */
+	int len = 1;
+	while(raw->line->cursor + len < raw->line->line->len && _raw_utf8_cont(_raw_gap_at(raw->line->line, raw->line->cursor + len)))
+		len++;
+
+	_raw_gap_delete(raw->line->line, raw->line->cursor, len);
+	_raw_dirty(raw, raw->line->cursor);
+
+	if(raw->line->cursor > raw->line->line->len)
+		raw->line->cursor = raw->line->line->len;
+
+	return SUCCESS;
+} /* _raw_del_char() */
+
+static int _raw_backspace(struct raw_t *raw) {
+	assert(raw->safe, "raw_t structure not allocated");
+
+	/* backspace is invalid if there is no input
+	 * or the cursor is at the start of the string */
+	if(!raw->line->line->len || raw->line->cursor < 1)
+		return BELL;
+
+	/* move cursor one to the left and do a delete */
+	_raw_move_cur(raw, -1);
+	return _raw_del_char(raw);
+} /* _raw_backspace() */
+
+#define _raw_delete(raw) _raw_del_char(raw)
+
+static int _raw_add_char(struct raw_t *raw, char ch) {
+	assert(raw->safe, "raw_t structure not allocated");
+
+	/* add char */
+	_raw_gap_insert(raw->line->line, raw->line->cursor, &ch, 1);
+	_raw_dirty(raw, raw->line->cursor);
+
+	/* update cursor */
+	raw->line->cursor++;
+	return SUCCESS;
+} /* _raw_add_char() */
+
+#define _raw_insert(raw, ch) _raw_add_char(raw, ch)
+
+static int _raw_add_str(struct raw_t *raw, char *str, int len) {
+	assert(raw->safe, "raw_t structure not allocated");
+
+	if(!len)
+		return SILENT;
+
+	/* add the whole string in one go */
+	_raw_gap_insert(raw->line->line, raw->line->cursor, str, len);
+	_raw_dirty(raw, raw->line->cursor);
+
+	/* update cursor */
+	raw->line->cursor += len;
+	return SUCCESS;
+} /* _raw_add_str() */
+
+/* The line is drawn right after the prompt and wraps at the edge of the terminal, so positions on the terminal (in
+ * columns after the prompt, see _raw_gap_cols()) are converted to rows and columns (relative to the row the prompt
+ * starts on) using the cached width. */
+
+static void _raw_out_move(struct raw_t *raw, int from, int to) {
+	int cols = raw->term->cols;
+
+	from += raw->line->pwidth;
+	to += raw->line->pwidth;
+
+	/* move to the correct row */
+	if(to / cols < from / cols)
+		_raw_out_csi(raw, from / cols - to / cols, C_CUR_MOVE_UP);
+	else if(to / cols > from / cols)
+		_raw_out_csi(raw, to / cols - from / cols, C_CUR_MOVE_DOWN);
+
+	/* move to the correct column */
+	if(to % cols < from % cols)
+		_raw_out_csi(raw, from % cols - to % cols, C_CUR_MOVE_BACK);
+	else if(to % cols > from % cols)
+		_raw_out_csi(raw, to % cols - from % cols, C_CUR_MOVE_FORWARD);
+} /* _raw_out_move() */
+
+static void _raw_out_text(struct raw_t *raw, char *str, int len) {
+	int i, start = 0;
+
+	/* Pasted text can contain control characters (which are kept in the line as-is), but writing them out would
+	 * mess up the terminal, so they are shown as a '?' instead. Anything else (including UTF-8) is written as-is. */
+	for(i = 0; i < len; i++) {
+		unsigned char ch = str[i];
+
+		if(ch > 31 && ch != 127)
+			continue;
+
+		_raw_buf_add(raw->term->out, str + start, i - start);
+		_raw_buf_add(raw->term->out, "?", 1);
+		start = i + 1;
+	}
+
+	_raw_buf_add(raw->term->out, str + start, len - start);
+} /* _raw_out_text() */
+
+static void _raw_out_line(struct raw_t *raw, int from, int cols) {
+	struct _raw_gap *gap = raw->line->line;
+	int pos = from;
+
+	/* write the line from the given position, on both sides of the gap */
+	if(pos < gap->start) {
+		_raw_out_text(raw, gap->buf + pos, gap->start - pos);
+		pos = gap->start;
+	}
+
+	_raw_out_text(raw, gap->buf + gap->end + pos - gap->start, gap->len - pos);
+
+	/* If the line ends on the edge of the terminal (at cols), the cursor is left on the last column until another
+	 * character is written. Move it to the start of the next row, so that it is where _raw_out_move() expects it. */
+	if(gap->len > from && (raw->line->pwidth + cols) % raw->term->cols == 0)
+		_raw_out_str(raw, C_CUR_NEXT_LINE);
+} /* _raw_out_line() */
+
+static void _raw_resize(struct raw_t *raw) {
+	int oldcols = raw->term->cols, from;
+	_raw_term_size(raw);
+
+	/* if the line fits on one row at both widths, nothing on the terminal has moved */
+	from = oldcols < raw->term->cols ? oldcols : raw->term->cols;
+	if(raw->term->cols == oldcols || raw->line->pwidth + raw->line->oldlen < from)
+		return;
+
+	/* Everything on the first row before the smaller of the two widths is still correct, and everything after it
+	 * has to be repainted. Go back to the first row, working out where the cursor is using the old width. */
+	int row = (raw->line->pwidth + raw->line->oldcursor) / oldcols;
+	if(row)
+		_raw_out_csi(raw, row, C_CUR_MOVE_UP);
+	_raw_out_str(raw, C_CUR_LINE_START);
+
+	/* the prompt can't be partially redrawn, because of escape sequences */
+	if(from < raw->line->pwidth) {
+		_raw_out_str(raw, raw->line->prompt->str);
+		from = raw->line->pwidth;
+	}
+	else if(from == raw->term->cols) {
+		/* the terminal got narrower, and the first row is still correct */
+		_raw_out_str(raw, C_CUR_NEXT_LINE);
+	}
+	else {
+		_raw_out_csi(raw, from, C_CUR_MOVE_FORWARD);
+	}
+
+	_raw_out_str(raw, C_SCR_CLEAR_END);
+
+	/* nothing after this point is on the terminal anymore (including the rest of any suggestion) */
+	raw->line->oldcursor = from - raw->line->pwidth;
+	raw->line->oldlen = raw->line->oldcursor;
+	raw->line->suggest = -1;
+	_raw_dirty(raw, _raw_gap_pos(raw->line->line, raw->line->oldcursor));
+} /* _raw_resize() */
+
+/* A history item starting with the line can be suggested after it (in grey), see _raw_hist_suggest(). */
+static int _raw_suggestion(struct raw_t *raw, char **item, int *len);
+
+static void _raw_out_suggest(struct raw_t *raw, char *item, int from, int to, int cols) {
+	if(from >= to)
+		return;
+
+	_raw_out_str(raw, C_FG_GREY);
+	_raw_out_text(raw, item + from, to - from);
+	_raw_out_str(raw, C_FG_DEFAULT);
+
+	/* like _raw_out_line(), don't leave the cursor on the edge of the terminal (at cols) */
+	if((raw->line->pwidth + cols) % raw->term->cols == 0)
+		_raw_out_str(raw, C_CUR_NEXT_LINE);
+} /* _raw_out_suggest() */
+
+static void _raw_suggest_hide(struct raw_t *raw) {
+	/* stop suggesting for this line, and clear the suggestion off the terminal */
+	raw->line->suggesting = false;
+	if(raw->line->suggest < 0)
+		return;
+
+	_raw_out_move(raw, raw->line->oldcursor, raw->line->suggestcol);
+	_raw_out_str(raw, C_SCR_CLEAR_END);
+
+	raw->line->oldcursor = raw->line->suggestcol;
+	raw->line->oldlen = raw->line->suggestcol;
+	raw->line->suggest = -1;
+} /* _raw_suggest_hide() */
+
+static void _raw_redraw(struct raw_t *raw) {
+	assert(raw->safe, "raw_t structure not allocated");
+
+	/* the terminal has been resized since the last redraw */
+	if(raw->term->winch != _raw_winch)
+		_raw_resize(raw);
+
+	/* Only the part of the line after the first change is repainted. Typing at the end of the line becomes a plain
+	 * append, an edit in the middle repaints the tail of the line and a movement only moves the cursor. */
+
+	/* moving back to the end of the line brings back the suggestion (without repainting any of the line) */
+	if(raw->line->dirty < 0 && raw->line->suggest < 0 && raw->line->suggesting && raw->line->line->len && raw->line->cursor == raw->line->line->len)
+		raw->line->dirty = raw->line->line->len;
+
+	if(raw->line->dirty >= 0) {
+		char *item;
+		int len = raw->line->line->len, end = len, to = len, seq = _raw_suggestion(raw, &item, &end);
+
+		/* the columns of the first change, the end of the line and the end of what is drawn after it */
+		int from = _raw_gap_cols(raw->line->line, 0, raw->line->dirty);
+		int cols = from + _raw_gap_cols(raw->line->line, raw->line->dirty, len), tocols = cols, endcols = cols;
+
+		/* move to the first change and redraw the rest of the line */
+		_raw_out_move(raw, raw->line->oldcursor, from);
+		_raw_out_line(raw, raw->line->dirty, cols);
+
+		/* Draw the rest of the suggested item after the line. If the same item is still suggested, the rest of it is
+		 * already on the terminal, so typing along the suggestion only redraws what was typed. Only the part which
+		 * was part of the line and no longer is (after a backspace) has to be drawn again in grey. */
+		if(seq >= 0) {
+			to = end;
+
+			if(seq == raw->line->suggest)
+				to = raw->line->suggestfrom > len ? raw->line->suggestfrom : len;
+
+			tocols = cols + _raw_cols(item + len, to - len);
+			endcols = tocols + _raw_cols(item + to, end - to);
+			_raw_out_suggest(raw, item, len, to, tocols);
+		}
+
+		/* clear out whatever is left over from the old line (which might have been on more than one row) */
+		if(endcols < raw->line->oldlen)
+			_raw_out_str(raw, C_SCR_CLEAR_END);
+
+		raw->line->oldcursor = tocols;
+		raw->line->oldlen = endcols;
+		raw->line->dirty = -1;
+
+		raw->line->suggest = seq;
+		raw->line->suggestfrom = len;
+		raw->line->suggestcol = cols;
+	}
+
+	/* update the cursor position */
+	int cursor = _raw_gap_cols(raw->line->line, 0, raw->line->cursor);
+	_raw_out_move(raw, raw->line->oldcursor, cursor);
+	raw->line->oldcursor = cursor;
+} /* _raw_redraw() */
+
+static void _raw_set_prompt(struct raw_t *raw, char *prompt) {
+	/* go back to the start of the prompt, and clear everything after it */
+	_raw_out_move(raw, raw->line->oldcursor, -raw->line->pwidth);
+	_raw_out_str(raw, C_SCR_CLEAR_END);
+
+	raw->line->prompt->str = prompt;
+	raw->line->prompt->len = strlen(prompt);
+	raw->line->pwidth = _raw_strwidth(prompt);
+	_raw_out_str(raw, prompt);
+
+	/* the whole line (and any suggestion) has to be drawn again after the new prompt */
+	raw->line->oldcursor = 0;
+	raw->line->oldlen = 0;
+	raw->line->dirty = 0;
+	raw->line->suggest = -1;
+} /* _raw_set_prompt() */
+
+/* == History == */
+
+static struct _raw_hist *_raw_hist_new(int size) {
+	struct _raw_hist *hist = _raw_malloc(sizeof(struct _raw_hist));
+
+	hist->max = size + 1;
+	hist->len = 0;
+	hist->count = 0;
+	hist->index = -1;
+
+	/* calloc(3) gets zeroed pages from the kernel for big histories, rather than touching all of them */
+	hist->history = _raw_calloc(hist->max, sizeof(char *));
+
+	hist->chunks = NULL;
+	hist->chunk = NULL;
+
+	hist->buffer = NULL;
+	hist->map = NULL;
+	hist->mapsize = 0;
+	hist->mapindex = NULL;
+	hist->mapcount = 0;
+
+	hist->dups = NULL;
+	hist->dupsize = 0;
+	hist->dupused = 0;
+	hist->erased = 0;
+
+	hist->frecency = NULL;
+
+	hist->grams = NULL;
+	hist->gramsize = 0;
+	hist->gramlen = 0;
+
+	hist->sorted = NULL;
+	hist->sortedlen = 0;
+	hist->pending = NULL;
+	hist->pendinglen = 0;
+	hist->pendingsize = 0;
+
+	hist->prefix = NULL;
+	hist->prefixlen = 0;
+
+	hist->suggestline = NULL;
+	hist->suggestnew = NULL;
+	hist->suggestnewlen = 0;
+	hist->suggestseq = -1;
+
+	hist->original = NULL;
+	hist->edits = NULL;
+	hist->editsize = 0;
+	hist->editlen = 0;
+
+	return hist;
+} /* _raw_hist_new() */
+
+/* History items are accessed by their index, where index 0 is the latest item. Since the history is a ring
+ * buffer, the item with a given index is (count - 1 - index) items after the first item ever added (its
+ * sequence number). */
+#define _raw_hist_seq(hist, index) ((hist)->count - 1 - (index))
+#define _raw_hist_slot(hist, index) (_raw_hist_seq(hist, index) % (hist)->max)
+#define _raw_hist_at(hist, index) ((hist)->history[_raw_hist_slot(hist, index)])
+
+/* Items from a mapped history file point into the mapping, and are never freed. */
+#define _raw_hist_mapped(hist, str) ((hist)->map && (str) >= (hist)->map && (str) < (hist)->map + (hist)->mapsize)
+
+/* Erased items keep their slot until the history is compacted, and are skipped over. */
+static char _raw_hist_tomb[] = "";
+#define _raw_hist_erased(str) ((str) == _raw_hist_tomb)
+
+/* Items are stored in an arena of chunks rather than allocated one by one. Each item is a record made of its length
+ * followed by the item (NUL terminated), so items can still be used as strings. Chunks are aligned to _RAW_CHUNK_SIZE
+ * (items bigger than that get an oversized chunk of their own), so the chunk of an item is found from its address.
+ * Items are added in order and the oldest are evicted first, so chunks are freed as soon as all of their items are
+ * gone, and freeing the history only has to free the chunks. */
+
+#define _RAW_CHUNK_SIZE 65536
+#define _RAW_CHUNK_HEADER ((int) ((sizeof(struct _raw_chunk) + sizeof(int) - 1) / sizeof(int) * sizeof(int)))
+
+#define _raw_chunk_of(str) ((struct _raw_chunk *) ((uintptr_t) (str) & ~(uintptr_t) (_RAW_CHUNK_SIZE - 1)))
+#define _raw_rec_len(str) (((int *) (str))[-1])
+
+/* Items which aren't in the arena (mapped or erased items) don't have a length. */
+#define _raw_hist_owned(hist, str) (!_raw_hist_mapped(hist, str) && !_raw_hist_erased(str))
+#define _raw_hist_len(hist, str) (_raw_hist_owned(hist, str) ? _raw_rec_len(str) : (int) strlen(str))
+
+static char *_raw_arena_add(struct _raw_hist *hist, char *str, int len) {
+	/* records are padded to keep the lengths aligned */
+	int size = (sizeof(int) + len + 1 + sizeof(int) - 1) / sizeof(int) * sizeof(int);
+	struct _raw_chunk *chunk = hist->chunk;
+
+	if(!chunk || chunk->used + size > chunk->size) {
+		int chunksize = _RAW_CHUNK_HEADER + size > _RAW_CHUNK_SIZE ? _RAW_CHUNK_HEADER + size : _RAW_CHUNK_SIZE;
+		void *mem = NULL;
+
+		assert(!posix_memalign(&mem, _RAW_CHUNK_SIZE, chunksize), "couldn't allocate enough memory");
+
+		chunk = mem;
+		chunk->prev = hist->chunk;
+		chunk->next = NULL;
+		chunk->size = chunksize;
+		chunk->used = _RAW_CHUNK_HEADER;
+		chunk->live = 0;
+
+		if(hist->chunk)
+			hist->chunk->next = chunk;
+		else
+			hist->chunks = chunk;
+		hist->chunk = chunk;
+	}
+
+	char *rec = (char *) chunk + chunk->used;
+	chunk->used += size;
+	chunk->live++;
+
+	*(int *) rec = len;
+	memcpy(rec + sizeof(int), str, len);
+	rec[sizeof(int) + len] = '\0';
+
+	return rec + sizeof(int);
+} /* _raw_arena_add() */
+
+static void _raw_arena_free(struct _raw_hist *hist) {
+	struct _raw_chunk *chunk = hist->chunks;
+
+	while(chunk) {
+		struct _raw_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+
+	hist->chunks = NULL;
+	hist->chunk = NULL;
+} /* _raw_arena_free() */
+
+static void _raw_hist_drop(struct _raw_hist *hist, char *str) {
+	if(!str || !_raw_hist_owned(hist, str))
+		return;
+
+	struct _raw_chunk *chunk = _raw_chunk_of(str);
+	if(--chunk->live)
+		return;
+
+	/* the latest chunk is kept around to be reused */
+	if(chunk == hist->chunk) {
+		chunk->used = _RAW_CHUNK_HEADER;
+		return;
+	}
+
+	if(chunk->prev)
+		chunk->prev->next = chunk->next;
+	else
+		hist->chunks = chunk->next;
+	chunk->next->prev = chunk->prev;
+
+	free(chunk);
+} /* _raw_hist_drop() */
+
+static char *_raw_hist_get_seq(struct _raw_hist *hist, int seq) {
+	char **item = &hist->history[seq % hist->max];
+
+	/* Items from a mapped history file are only looked up when they are first used, so mapping a history
+	 * doesn't depend on its size. A bad offset gives an empty item (the last byte of the mapping is a NUL),
+	 * rather than reading outside of the mapping. */
+	if(!*item && seq < hist->mapcount) {
+		uint32_t off = hist->mapindex[seq];
+		*item = hist->map + (off < hist->mapsize ? off : hist->mapsize - 1);
+	}
+
+	return *item;
+} /* _raw_hist_get_seq() */
+
+#define _raw_hist_get(hist, index) _raw_hist_get_seq(hist, _raw_hist_seq(hist, index))
+
+static void _raw_set_line(struct raw_t *raw, char *str, int cursor) {
+	assert(raw->safe, "raw_t structure not allocated");
+
+	int len = strlen(str);
+
+	/* only the part of the line after the common prefix (back to the start of a UTF-8 character) has changed */
+	int same = _raw_gap_prefix(raw->line->line, str, len);
+	while(same > 0 && same < len && _raw_utf8_cont(str[same]))
+		same--;
+
+	if(same < len || same < raw->line->line->len)
+		_raw_dirty(raw, same);
+
+	/* copy over the string to line */
+	_raw_gap_set(raw->line->line, str, len);
+
+	/* update cursor */
+	raw->line->cursor = cursor;
+
+	/* if the given cursor position is illogical, move it to start */
+	if(raw->line->cursor < 0 || raw->line->cursor > len)
+		raw->line->cursor = 0;
+} /* _raw_set_line() */
+
+static void _raw_hist_reset(struct _raw_hist *hist) {
+	/* throw away any edits made while browsing the history */
+	if(hist->edits) {
+		int i;
+		for(i = 0; i < hist->editsize; i++)
+			free(hist->edits[i].str);
+		free(hist->edits);
+	}
+
+	free(hist->original);
+	hist->original = NULL;
+
+	free(hist->prefix);
+	hist->prefix = NULL;
+	hist->prefixlen = 0;
+
+	hist->edits = NULL;
+	hist->editsize = 0;
+	hist->editlen = 0;
+	hist->index = -1;
+} /* _raw_hist_reset() */
+
+/* With frecency kept, every item has a use count and the time it was last used. An item added again takes over the use
+ * count of its older duplicate, so the counters follow the item rather than the slot. Items are then ranked by their
+ * use count, weighted by how long ago they were last used (ties go to the latest item). */
+
+#define _raw_uses(f) ((f)->uses ? (f)->uses : 1)
+
+static long _raw_frecency_score(struct _raw_hist *hist, int seq, time_t now) {
+	struct _raw_frecency *f = &hist->frecency[seq % hist->max];
+	long uses = _raw_uses(f), age = now - f->used;
+
+	if(age < 60 * 60)
+		return uses * 16;
+	if(age < 24 * 60 * 60)
+		return uses * 8;
+	if(age < 7 * 24 * 60 * 60)
+		return uses * 2;
+	return uses;
+} /* _raw_frecency_score() */
+
+static bool _raw_hist_better(struct _raw_hist *hist, int a, int b, time_t now) {
+	/* without frecency, the latest item is the best */
+	if(hist->frecency) {
+		long sa = _raw_frecency_score(hist, a, now), sb = _raw_frecency_score(hist, b, now);
+		if(sa != sb)
+			return sa > sb;
+	}
+
+	return a > b;
+} /* _raw_hist_better() */
+
+static void _raw_rank_add(struct _raw_hist *hist, struct _raw_rank *rank, int seq) {
+	int i, child;
+
+	/* Only the best size items are kept, in a heap with the worst of them at the top. Ranking m items only takes
+	 * O(m log size), rather than sorting all of them. */
+	if(rank->len < rank->size) {
+		for(i = rank->len++; i && _raw_hist_better(hist, rank->seqs[(i - 1) / 2], seq, rank->now); i = (i - 1) / 2)
+			rank->seqs[i] = rank->seqs[(i - 1) / 2];
+
+		rank->seqs[i] = seq;
+		return;
+	}
+
+	/* the item has to be better than the worst item kept to replace it */
+	if(!_raw_hist_better(hist, seq, rank->seqs[0], rank->now))
+		return;
+
+	for(i = 0; (child = 2 * i + 1) < rank->len; i = child) {
+		if(child + 1 < rank->len && _raw_hist_better(hist, rank->seqs[child], rank->seqs[child + 1], rank->now))
+			child++;
+		if(!_raw_hist_better(hist, seq, rank->seqs[child], rank->now))
+			break;
+
+		rank->seqs[i] = rank->seqs[child];
+	}
+
+	rank->seqs[i] = seq;
+} /* _raw_rank_add() */
+
+/* Searching the history uses an index from each trigram (three consecutive bytes) to the items containing it, in the
+ * order they were added. An item can only contain the search string if it contains every trigram of it, so only the
+ * items in the shortest list have to be checked. The index is built when a history is loaded (or on the first search
+ * of a history which was only added to), and from then on it is kept up to date as items are added and evicted.
+ * Erased items are left in the index, and are skipped when searching, until the history is compacted. */
+
+#define _raw_gram_of(str) ((((uint32_t) (unsigned char) (str)[0] << 16) | ((uint32_t) (unsigned char) (str)[1] << 8) \
+		| (uint32_t) (unsigned char) (str)[2]) + 1)
+#define _raw_gram_hash(gram, size) (((gram) * 2654435761u) & ((size) - 1))
+
+static struct _raw_gram *_raw_gram_find(struct _raw_hist *hist, uint32_t gram, bool create) {
+	unsigned i;
+
+	/* grow the table, keeping it at most half full */
+	if(create && (hist->gramlen + 1) * 2 > hist->gramsize) {
+		struct _raw_gram *old = hist->grams;
+		int j, oldsize = hist->gramsize;
+
+		hist->gramsize = oldsize ? oldsize * 2 : 1024;
+		hist->grams = _raw_calloc(hist->gramsize, sizeof(struct _raw_gram));
+
+		for(j = 0; j < oldsize; j++) {
+			if(!old[j].gram)
+				continue;
+
+			i = _raw_gram_hash(old[j].gram, hist->gramsize);
+			while(hist->grams[i].gram)
+				i = (i + 1) & (hist->gramsize - 1);
+			hist->grams[i] = old[j];
+		}
+
+		free(old);
+	}
+
+	i = _raw_gram_hash(gram, hist->gramsize);
+	while(hist->grams[i].gram) {
+		if(hist->grams[i].gram == gram)
+			return &hist->grams[i];
+		i = (i + 1) & (hist->gramsize - 1);
+	}
+
+	if(!create)
+		return NULL;
+
+	hist->grams[i].gram = gram;
+	hist->gramlen++;
+	return &hist->grams[i];
+} /* _raw_gram_find() */
+
+static int _raw_gram_pos(struct _raw_gram *gram, int seq) {
+	/* find the last sequence number in the list which isn't after seq (start - 1 if there isn't one) */
+	int lo = gram->start, hi = gram->len;
+	while(lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if(gram->seqs[mid] <= seq)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo - 1;
+} /* _raw_gram_pos() */
+
+static void _raw_grams_add(struct _raw_hist *hist, int seq, char *str, int len) {
+	int i;
+	for(i = 0; i + 3 <= len; i++) {
+		struct _raw_gram *gram = _raw_gram_find(hist, _raw_gram_of(str + i), true);
+
+		/* items are added in order, so a trigram repeated in the same item is already at the end */
+		if(gram->len > gram->start && gram->seqs[gram->len - 1] == seq)
+			continue;
+
+		if(gram->len == gram->size) {
+			gram->size = gram->size ? gram->size * 2 : 4;
+			gram->seqs = _raw_realloc(gram->seqs, sizeof(int) * gram->size);
+		}
+
+		gram->seqs[gram->len++] = seq;
+	}
+} /* _raw_grams_add() */
+
+static void _raw_grams_evict(struct _raw_hist *hist, int seq, char *str, int len) {
+	int i;
+	for(i = 0; i + 3 <= len; i++) {
+		struct _raw_gram *gram = _raw_gram_find(hist, _raw_gram_of(str + i), false);
+		if(!gram)
+			continue;
+
+		/* the evicted item is the oldest, so it (and any erased items before it) are at the front of the list */
+		while(gram->start < gram->len && gram->seqs[gram->start] <= seq)
+			gram->start++;
+
+		/* move the list back to the start of its allocation once half of it is unused */
+		if(gram->start == gram->len) {
+			gram->start = gram->len = 0;
+		}
+		else if(gram->start * 2 >= gram->len) {
+			gram->len -= gram->start;
+			memmove(gram->seqs, gram->seqs + gram->start, sizeof(int) * gram->len);
+			gram->start = 0;
+		}
+	}
+} /* _raw_grams_evict() */
+
+static void _raw_grams_free(struct _raw_hist *hist) {
+	int i;
+	for(i = 0; i < hist->gramsize; i++)
+		free(hist->grams[i].seqs);
+	free(hist->grams);
+
+	hist->grams = NULL;
+	hist->gramsize = 0;
+	hist->gramlen = 0;
+} /* _raw_grams_free() */
+
+static void _raw_grams_build(struct _raw_hist *hist) {
+	int seq;
+
+	/* make sure the table exists, even if there aren't any trigrams */
+	hist->gramsize = 1024;
+	hist->grams = _raw_calloc(hist->gramsize, sizeof(struct _raw_gram));
+
+	for(seq = hist->count - hist->len; seq < hist->count; seq++) {
+		char *item = _raw_hist_get_seq(hist, seq);
+		if(!_raw_hist_erased(item))
+			_raw_grams_add(hist, seq, item, _raw_hist_len(hist, item));
+	}
+} /* _raw_grams_build() */
+
+static void _raw_grams_renumber(struct _raw_hist *hist, int *seqs, int first) {
+	int i, j;
+
+	/* Seqs has the new sequence number of each old one from first onwards (-1 for erased items, which are dropped).
+	 * Erased items which have already left the ring can still be at the front of a list, and are dropped too. */
+	for(i = 0; i < hist->gramsize; i++) {
+		struct _raw_gram *gram = &hist->grams[i];
+		int len = 0;
+
+		/* the items keep their order, so each list stays sorted */
+		for(j = gram->start; j < gram->len; j++)
+			if(gram->seqs[j] >= first && seqs[gram->seqs[j] - first] >= 0)
+				gram->seqs[len++] = seqs[gram->seqs[j] - first];
+
+		gram->start = 0;
+		gram->len = len;
+	}
+} /* _raw_grams_renumber() */
+
+static int _raw_hist_search(struct _raw_hist *hist, char *str, int from, struct _raw_rank *rank) {
+	int i, index, len = strlen(str);
+
+	/* if rank is given, every item containing str (from from onwards) is ranked, rather than just finding the first */
+
+	if(from < 0)
+		from = 0;
+
+	/* strings without a trigram are common enough to be found quickly by checking every item */
+	if(len < 3) {
+		for(index = from; index < hist->len; index++) {
+			char *item = _raw_hist_get(hist, index);
+			if(_raw_hist_erased(item) || !strstr(item, str))
+				continue;
+
+			if(!rank)
+				return index;
+			_raw_rank_add(hist, rank, _raw_hist_seq(hist, index));
+		}
+		return -1;
+	}
+
+	if(!hist->grams)
+		_raw_grams_build(hist);
+
+	/* find the lists of every trigram in the string, sorted from the shortest to the longest */
+	struct _raw_gram **grams = _raw_malloc(sizeof(struct _raw_gram *) * (len - 2)), *rare;
+	int j, ngrams = 0, ret = -1;
+
+	for(i = 0; i + 3 <= len; i++) {
+		rare = _raw_gram_find(hist, _raw_gram_of(str + i), false);
+
+		/* no item has this trigram */
+		if(!rare || rare->start == rare->len)
+			goto end;
+
+		for(j = ngrams; j > 0 && grams[j - 1]->len - grams[j - 1]->start > rare->len - rare->start; j--)
+			grams[j] = grams[j - 1];
+		grams[j] = rare;
+		ngrams++;
+	}
+
+	/* go through the items in the shortest list, from the latest item which isn't newer than from */
+	int pos, oldest = hist->count - hist->len;
+	rare = grams[0];
+
+	for(pos = _raw_gram_pos(rare, _raw_hist_seq(hist, from)); pos >= rare->start && rare->seqs[pos] >= oldest; pos--) {
+		int seq = rare->seqs[pos];
+
+		/* the item has to be in every other list (the shorter lists are the most likely to rule it out) */
+		for(i = 1; i < ngrams; i++) {
+			int other = _raw_gram_pos(grams[i], seq);
+			if(other < grams[i]->start || grams[i]->seqs[other] != seq)
+				break;
+		}
+
+		if(i < ngrams)
+			continue;
+
+		/* the trigrams could be anywhere in the item, so check that it actually has the string */
+		char *item = _raw_hist_get_seq(hist, seq);
+		if(_raw_hist_erased(item) || !strstr(item, str))
+			continue;
+
+		if(!rank) {
+			ret = hist->count - 1 - seq;
+			break;
+		}
+		_raw_rank_add(hist, rank, seq);
+	}
+
+end:
+	free(grams);
+	return ret;
+} /* _raw_hist_search() */
+
+static int _raw_hist_ranked(struct _raw_hist *hist, char *str, int nth) {
+	struct _raw_rank rank;
+
+	/* find the nth best item containing str (counting from 0), which is the worst of the best nth + 1 */
+	rank.seqs = _raw_malloc(sizeof(int) * (nth + 1));
+	rank.len = 0;
+	rank.size = nth + 1;
+	rank.now = time(NULL);
+
+	_raw_hist_search(hist, str, 0, &rank);
+
+	int ret = rank.len == rank.size ? hist->count - 1 - rank.seqs[0] : -1;
+	free(rank.seqs);
+	return ret;
+} /* _raw_hist_ranked() */
+
+/* Prefix navigation uses an index of the items sorted by their text, so the items starting with a string are found
+ * with a binary search. Items added since the index was last sorted are kept in a list of their own (in the order they
+ * were added), which is merged into the index once it gets long enough. Evicted and erased items are removed from the
+ * index (leaving a hole, which is dropped by the next merge) before they are freed. */
+
+#define _RAW_SORTED_HOLE -1
+
+/* positions in the index (and the added items) change, so suggestions have to be worked out again */
+#define _raw_suggest_reset(hist) do { if((hist)->suggestline) (hist)->suggestline->len = 0; } while(0)
+
+static int _raw_sorted_cmp(struct _raw_hist *hist, int a, int b) {
+	int ret = strcmp(_raw_hist_get_seq(hist, a), _raw_hist_get_seq(hist, b));
+	return ret ? ret : a - b;
+} /* _raw_sorted_cmp() */
+
+static void _raw_sorted_sort(struct _raw_hist *hist, int *seqs, int *tmp, int len) {
+	if(len < 2)
+		return;
+
+	/* merge sort, since qsort(3) can't be given the history */
+	int half = len / 2, i = 0, j = half, k = 0;
+	_raw_sorted_sort(hist, seqs, tmp, half);
+	_raw_sorted_sort(hist, seqs + half, tmp, len - half);
+
+	while(i < half && j < len)
+		tmp[k++] = _raw_sorted_cmp(hist, seqs[i], seqs[j]) <= 0 ? seqs[i++] : seqs[j++];
+	while(i < half)
+		tmp[k++] = seqs[i++];
+	while(j < len)
+		tmp[k++] = seqs[j++];
+
+	memcpy(seqs, tmp, sizeof(int) * len);
+} /* _raw_sorted_sort() */
+
+static void _raw_sorted_free(struct _raw_hist *hist) {
+	free(hist->sorted);
+	free(hist->pending);
+	_raw_suggest_reset(hist);
+
+	hist->sorted = NULL;
+	hist->sortedlen = 0;
+	hist->pending = NULL;
+	hist->pendinglen = 0;
+	hist->pendingsize = 0;
+} /* _raw_sorted_free() */
+
+static void _raw_sorted_build(struct _raw_hist *hist) {
+	int seq;
+
+	hist->sorted = _raw_malloc(sizeof(int) * (hist->len + 1));
+	hist->sortedlen = 0;
+
+	for(seq = hist->count - hist->len; seq < hist->count; seq++)
+		if(!_raw_hist_erased(_raw_hist_get_seq(hist, seq)))
+			hist->sorted[hist->sortedlen++] = seq;
+
+	int *tmp = _raw_malloc(sizeof(int) * (hist->sortedlen + 1));
+	_raw_sorted_sort(hist, hist->sorted, tmp, hist->sortedlen);
+	free(tmp);
+} /* _raw_sorted_build() */
+
+static void _raw_sorted_merge(struct _raw_hist *hist) {
+	int i, j = 0, k = 0, len = 0, oldest = hist->count - hist->len;
+
+	/* drop the added items which have already been evicted or erased (they can't be compared) */
+	for(i = 0; i < hist->pendinglen; i++)
+		if(hist->pending[i] >= oldest && !_raw_hist_erased(_raw_hist_get_seq(hist, hist->pending[i])))
+			hist->pending[len++] = hist->pending[i];
+
+	int *tmp = _raw_malloc(sizeof(int) * (len + 1));
+	_raw_sorted_sort(hist, hist->pending, tmp, len);
+	free(tmp);
+
+	/* merge the two lists, dropping the holes */
+	int *sorted = _raw_malloc(sizeof(int) * (hist->sortedlen + len + 1));
+	for(i = 0; i < hist->sortedlen; i++) {
+		if(hist->sorted[i] == _RAW_SORTED_HOLE)
+			continue;
+
+		while(j < len && _raw_sorted_cmp(hist, hist->pending[j], hist->sorted[i]) < 0)
+			sorted[k++] = hist->pending[j++];
+		sorted[k++] = hist->sorted[i];
+	}
+
+	while(j < len)
+		sorted[k++] = hist->pending[j++];
+
+	free(hist->sorted);
+	hist->sorted = sorted;
+	hist->sortedlen = k;
+	hist->pendinglen = 0;
+	_raw_suggest_reset(hist);
+} /* _raw_sorted_merge() */
+
+static void _raw_sorted_add(struct _raw_hist *hist, int seq) {
+	if(hist->pendinglen == hist->pendingsize) {
+		hist->pendingsize = hist->pendingsize ? hist->pendingsize * 2 : 64;
+		hist->pending = _raw_realloc(hist->pending, sizeof(int) * hist->pendingsize);
+	}
+
+	hist->pending[hist->pendinglen++] = seq;
+	_raw_suggest_reset(hist);
+
+	/* merging is linear, so only merge once the added items are a good part of the index */
+	if(hist->pendinglen > 64 && hist->pendinglen * 16 > hist->sortedlen)
+		_raw_sorted_merge(hist);
+} /* _raw_sorted_add() */
+
+static int _raw_sorted_find(struct _raw_hist *hist, char *str, int seq) {
+	/* find the first item in the index which isn't before (str, seq), skipping over holes */
+	int lo = 0, hi = hist->sortedlen;
+	while(lo < hi) {
+		int mid = lo + (hi - lo) / 2, pos = mid;
+		while(pos < hi && hist->sorted[pos] == _RAW_SORTED_HOLE)
+			pos++;
+
+		if(pos == hi) {
+			hi = mid;
+			continue;
+		}
+
+		int cmp = strcmp(_raw_hist_get_seq(hist, hist->sorted[pos]), str);
+		if(cmp < 0 || (!cmp && hist->sorted[pos] < seq))
+			lo = pos + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+} /* _raw_sorted_find() */
+
+static void _raw_sorted_remove(struct _raw_hist *hist, int seq, char *str) {
+	_raw_suggest_reset(hist);
+
+	/* added items which haven't been merged yet are just skipped over once they're gone */
+	if(hist->pendinglen && seq >= hist->pending[0])
+		return;
+
+	int pos = _raw_sorted_find(hist, str, seq);
+	while(pos < hist->sortedlen && hist->sorted[pos] == _RAW_SORTED_HOLE)
+		pos++;
+
+	if(pos < hist->sortedlen && hist->sorted[pos] == seq)
+		hist->sorted[pos] = _RAW_SORTED_HOLE;
+} /* _raw_sorted_remove() */
+
+static void _raw_sorted_renumber(struct _raw_hist *hist, int *seqs, int first) {
+	int i, len = 0;
+
+	/* renumbering keeps the order of the items (and their text), so the index stays sorted without the holes */
+	for(i = 0; i < hist->sortedlen; i++)
+		if(hist->sorted[i] >= first && seqs[hist->sorted[i] - first] >= 0)
+			hist->sorted[len++] = seqs[hist->sorted[i] - first];
+	hist->sortedlen = len;
+
+	/* as do the added items, some of which might have been evicted or erased */
+	for(i = len = 0; i < hist->pendinglen; i++)
+		if(hist->pending[i] >= first && seqs[hist->pending[i] - first] >= 0)
+			hist->pending[len++] = seqs[hist->pending[i] - first];
+	hist->pendinglen = len;
+
+	_raw_suggest_reset(hist);
+} /* _raw_sorted_renumber() */
+
+/* The suggestion for a line is the latest (or best ranked) item which starts with it (and is longer than it). Those
+ * items are a range of the sorted index, plus some of the items which haven't been sorted yet. Typing at the end of the
+ * line can only narrow them down, so each keystroke narrows the range (with a binary search inside it) and the unsorted
+ * items found for the line before it, instead of going through the history again. The best item in the range is only
+ * looked for again once the item which was suggested stops matching. */
+
+static int _raw_sorted_bound(struct _raw_hist *hist, char *str, int len, int from, int lo, int hi) {
+	/* find the first item in sorted[lo, hi) which is after str (only comparing the first len bytes of items, unless
+	 * len is -1), skipping over holes. Every item in the range starts with the first from bytes of str. */
+	while(lo < hi) {
+		int mid = lo + (hi - lo) / 2, pos = mid;
+		while(pos < hi && hist->sorted[pos] == _RAW_SORTED_HOLE)
+			pos++;
+
+		if(pos == hi) {
+			hi = mid;
+			continue;
+		}
+
+		char *item = _raw_hist_get_seq(hist, hist->sorted[pos]) + from;
+		int cmp = len < 0 ? strcmp(item, str + from) : strncmp(item, str + from, len - from);
+		if(cmp <= 0)
+			lo = pos + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+} /* _raw_sorted_bound() */
+
+#define _raw_suggest_match(item, line, from, len) (!strncmp((item) + (from), (line) + (from), (len) - (from)) && (item)[len] != '\0')
+
+static int _raw_hist_suggest(struct _raw_hist *hist, char *line, int len) {
+	int i, from, n = 0, oldest = hist->count - hist->len;
+
+	if(!hist->sorted)
+		_raw_sorted_build(hist);
+	if(!hist->suggestline)
+		hist->suggestline = _raw_buf_new(64);
+
+	struct _raw_buf *prev = hist->suggestline;
+
+	if(prev->len && prev->len <= len && !memcmp(prev->buf, line, prev->len)) {
+		/* the line carries on from the line before, so its candidates are narrowed down */
+		if(prev->len == len)
+			return hist->suggestseq;
+		from = prev->len;
+	}
+	else {
+		/* start again from the whole index, and every added item which is still in the history */
+		hist->suggestlo = 0;
+		hist->suggesthi = hist->sortedlen;
+		hist->suggestseq = -1;
+
+		hist->suggestnew = _raw_realloc(hist->suggestnew, sizeof(int) * (hist->pendinglen + 1));
+		hist->suggestnewlen = 0;
+		for(i = hist->pendinglen - 1; i >= 0 && hist->pending[i] >= oldest; i--)
+			if(!_raw_hist_erased(_raw_hist_get_seq(hist, hist->pending[i])))
+				hist->suggestnew[hist->suggestnewlen++] = hist->pending[i];
+
+		from = 0;
+	}
+
+	/* narrow down the added items (which are all newer than the sorted ones) */
+	for(i = 0; i < hist->suggestnewlen; i++)
+		if(_raw_suggest_match(_raw_hist_get_seq(hist, hist->suggestnew[i]), line, from, len))
+			hist->suggestnew[n++] = hist->suggestnew[i];
+	hist->suggestnewlen = n;
+
+	/* narrow down the range of the index (items equal to the line are at the start of it, and are left out) */
+	hist->suggestlo = _raw_sorted_bound(hist, line, -1, from, hist->suggestlo, hist->suggesthi);
+	hist->suggesthi = _raw_sorted_bound(hist, line, len, from, hist->suggestlo, hist->suggesthi);
+
+	/* the best item for the line before is still the best if it still matches, since nothing better can match */
+	int seq = hist->suggestseq;
+	if(seq < 0 || !_raw_suggest_match(_raw_hist_get_seq(hist, seq), line, from, len)) {
+		time_t now = hist->frecency ? time(NULL) : 0;
+
+		/* The latest item is suggested, which is the first added item (or the latest item in the range, if there
+		 * aren't any). With frecency kept, the best ranked of all of them is suggested instead. */
+		seq = n ? hist->suggestnew[0] : -1;
+		if(hist->frecency)
+			for(i = 1; i < n; i++)
+				if(_raw_hist_better(hist, hist->suggestnew[i], seq, now))
+					seq = hist->suggestnew[i];
+
+		if(!n || hist->frecency)
+			for(i = hist->suggestlo; i < hist->suggesthi; i++)
+				if(hist->sorted[i] != _RAW_SORTED_HOLE && (seq < 0 || _raw_hist_better(hist, hist->sorted[i], seq, now)))
+					seq = hist->sorted[i];
+	}
+
+	prev->len = 0;
+	_raw_buf_add(prev, line, len);
+	hist->suggestseq = seq;
+
+	return seq;
+} /* _raw_hist_suggest() */
+
+static void _raw_hist_free(struct _raw_hist *hist) {
+	_raw_hist_reset(hist);
+
+	/* the items are all in the arena */
+	_raw_arena_free(hist);
+	free(hist->history);
+
+	free(hist->dups);
+	hist->dups = NULL;
+	free(hist->frecency);
+	hist->frecency = NULL;
+
+	if(hist->grams)
+		_raw_grams_free(hist);
+
+	_raw_sorted_free(hist);
+
+	if(hist->suggestline)
+		_raw_buf_free(hist->suggestline);
+	free(hist->suggestnew);
+	hist->suggestline = NULL;
+	hist->suggestnew = NULL;
+
+	free(hist->buffer);
+
+	if(hist->map)
+		munmap(hist->map, hist->mapsize);
+	hist->map = NULL;
+
+	hist->len = 0;
+	hist->max = 0;
+} /* _raw_hist_free() */
+
+/* When older duplicates are erased, the history keeps a hash table from each item to its sequence number, so a
+ * duplicate can be found without searching the history. The table uses open addressing, with removed items being
+ * left as markers until the table is rebuilt. */
+
+#define _RAW_DUP_EMPTY -1
+#define _RAW_DUP_REMOVED -2
+
+static unsigned _raw_hist_hash_str(char *str, int len) {
+	/* FNV-1a */
+	unsigned hash = 2166136261u;
+	while(len--)
+		hash = (hash ^ (unsigned char) *str++) * 16777619u;
+	return hash;
+} /* _raw_hist_hash_str() */
+
+static bool _raw_hist_same(struct _raw_hist *hist, int seq, char *str, int len) {
+	char *item = _raw_hist_get_seq(hist, seq);
+	return _raw_hist_len(hist, item) == len && !memcmp(item, str, len);
+} /* _raw_hist_same() */
+
+static int _raw_hist_dup_find(struct _raw_hist *hist, char *str, int len) {
+	unsigned i = _raw_hist_hash_str(str, len) & (hist->dupsize - 1);
+
+	while(hist->dups[i] != _RAW_DUP_EMPTY) {
+		if(hist->dups[i] >= 0 && _raw_hist_same(hist, hist->dups[i], str, len))
+			return hist->dups[i];
+		i = (i + 1) & (hist->dupsize - 1);
+	}
+
+	return -1;
+} /* _raw_hist_dup_find() */
+
+static void _raw_hist_dup_remove(struct _raw_hist *hist, int seq) {
+	char *item = _raw_hist_get_seq(hist, seq);
+	unsigned i = _raw_hist_hash_str(item, _raw_hist_len(hist, item)) & (hist->dupsize - 1);
+
+	while(hist->dups[i] != _RAW_DUP_EMPTY) {
+		if(hist->dups[i] == seq) {
+			hist->dups[i] = _RAW_DUP_REMOVED;
+			return;
+		}
+		i = (i + 1) & (hist->dupsize - 1);
+	}
+} /* _raw_hist_dup_remove() */
+
+static void _raw_hist_dup_build(struct _raw_hist *hist) {
+	int i, seq;
+
+	/* keep the table at most half full, even once the history is full */
+	free(hist->dups);
+	for(hist->dupsize = 8; hist->dupsize < hist->max * 2; hist->dupsize *= 2)
+		;
+
+	hist->dups = _raw_malloc(sizeof(int) * hist->dupsize);
+	for(i = 0; i < hist->dupsize; i++)
+		hist->dups[i] = _RAW_DUP_EMPTY;
+
+	hist->dupused = 0;
+	for(seq = hist->count - hist->len; seq < hist->count; seq++) {
+		char *item = _raw_hist_get_seq(hist, seq);
+		if(_raw_hist_erased(item))
+			continue;
+
+		/* only the latest copy of each item is kept (a later copy replaces an earlier one) */
+		int len = _raw_hist_len(hist, item);
+		unsigned j = _raw_hist_hash_str(item, len) & (hist->dupsize - 1);
+		while(hist->dups[j] != _RAW_DUP_EMPTY && !_raw_hist_same(hist, hist->dups[j], item, len))
+			j = (j + 1) & (hist->dupsize - 1);
+
+		if(hist->dups[j] == _RAW_DUP_EMPTY)
+			hist->dupused++;
+		hist->dups[j] = seq;
+	}
+} /* _raw_hist_dup_build() */
+
+static void _raw_hist_dup_add(struct _raw_hist *hist, int seq) {
+	/* too many removed items make the searches long, so get rid of them */
+	if((hist->dupused + 1) * 2 > hist->dupsize) {
+		_raw_hist_dup_build(hist);
+		return;
+	}
+
+	char *item = _raw_hist_get_seq(hist, seq);
+	unsigned i = _raw_hist_hash_str(item, _raw_hist_len(hist, item)) & (hist->dupsize - 1);
+	while(hist->dups[i] >= 0)
+		i = (i + 1) & (hist->dupsize - 1);
+
+	if(hist->dups[i] == _RAW_DUP_EMPTY)
+		hist->dupused++;
+	hist->dups[i] = seq;
+} /* _raw_hist_dup_add() */
+
+#define _RAW_HIST_SLACK 16 /* a full history is compacted once this fraction of it is erased */
+
+static void _raw_hist_compact(struct _raw_hist *hist) {
+	char **history = _raw_calloc(hist->max, sizeof(char *));
+	struct _raw_frecency *frecency = hist->frecency ? _raw_calloc(hist->max, sizeof(struct _raw_frecency)) : NULL;
+	struct _raw_chunk *chunks = hist->chunks;
+	int seq, len = 0, first = hist->count - hist->len;
+	int *seqs = hist->grams || hist->sorted ? _raw_malloc(sizeof(int) * hist->len) : NULL;
+
+	/* start a new arena, so the space left by erased items is given back */
+	hist->chunks = NULL;
+	hist->chunk = NULL;
+
+	/* move the items which haven't been erased to the start of a new ring (which renumbers them) */
+	for(seq = hist->count - hist->len; seq < hist->count; seq++) {
+		char *item = _raw_hist_get_seq(hist, seq);
+
+		if(seqs)
+			seqs[seq - first] = _raw_hist_erased(item) ? -1 : len;
+
+		if(_raw_hist_erased(item))
+			continue;
+
+		if(!_raw_hist_mapped(hist, item))
+			item = _raw_arena_add(hist, item, _raw_rec_len(item));
+
+		/* the counters move with the item */
+		if(frecency)
+			frecency[len] = hist->frecency[seq % hist->max];
+
+		history[len++] = item;
+	}
+
+	/* free the old arena */
+	while(chunks) {
+		struct _raw_chunk *next = chunks->next;
+		free(chunks);
+		chunks = next;
+	}
+
+	free(hist->history);
+	hist->history = history;
+	free(hist->frecency);
+	hist->frecency = frecency;
+
+	hist->len = len;
+	hist->count = len;
+	hist->erased = 0;
+
+	/* every mapped item has been looked up, and they all have new sequence numbers */
+	hist->mapcount = 0;
+
+	if(hist->dups)
+		_raw_hist_dup_build(hist);
+
+	/* the search and prefix indexes move along with the items */
+	if(hist->grams)
+		_raw_grams_renumber(hist, seqs, first);
+	if(hist->sorted)
+		_raw_sorted_renumber(hist, seqs, first);
+	free(seqs);
+} /* _raw_hist_compact() */
+
+static bool _raw_hist_add_len(struct raw_t *raw, char *str, int len) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->history, "raw_t history not enabled");
+
+	struct _raw_hist *hist = raw->hist;
+	time_t now = hist->frecency ? time(NULL) : 0;
+	int uses = 0;
+
+	/* do not add duplicate consecutive entries in history (they are still another use of the latest item) */
+	if(hist->len && !strncmp(_raw_hist_get(hist, 0), str, len) && _raw_hist_at(hist, 0)[len] == '\0') {
+		if(hist->frecency) {
+			struct _raw_frecency *f = &hist->frecency[(hist->count - 1) % hist->max];
+			f->uses = _raw_uses(f) + 1;
+			f->used = now;
+			_raw_suggest_reset(hist);
+		}
+		return false;
+	}
+
+	/* Find the latest older duplicate (the table only keeps the latest copy of each item). The item takes over its
+	 * use count, and if older duplicates are erased, it is erased (leaving its slot behind). */
+	if(raw->settings->erasedups || hist->frecency) {
+		if(!hist->dups)
+			_raw_hist_dup_build(hist);
+
+		int seq = _raw_hist_dup_find(hist, str, len);
+		if(seq >= 0) {
+			_raw_hist_dup_remove(hist, seq);
+			if(hist->frecency)
+				uses = _raw_uses(&hist->frecency[seq % hist->max]);
+		}
+
+		if(seq >= 0 && raw->settings->erasedups) {
+			if(hist->sorted)
+				_raw_sorted_remove(hist, seq, _raw_hist_get_seq(hist, seq));
+			_raw_hist_drop(hist, _raw_hist_get_seq(hist, seq));
+
+			hist->history[seq % hist->max] = _raw_hist_tomb;
+			hist->erased++;
+		}
+	}
+
+	/* A full history with erased items in it pushes out live items while the erased ones still take up slots, so
+	 * they are gotten rid of once they make up 1/_RAW_HIST_SLACK of it (so each compaction is paid for by that many
+	 * erased items). A history which is being browsed can't be renumbered, so it has to wait. */
+	if(hist->len == hist->max && hist->erased * _RAW_HIST_SLACK >= hist->max && hist->index < 0 && !hist->edits)
+		_raw_hist_compact(hist);
+
+	/* The history is a ring buffer, so adding an item just takes the slot after the latest item, which (if the
+	 * history is full) is the slot of the oldest item. Nothing else has to be moved. */
+	hist->count++;
+
+	/* free the oldest item in the history (if the history is full) */
+	if(hist->len == hist->max) {
+		int seq = hist->count - 1 - hist->max;
+		char *oldest = _raw_hist_get_seq(hist, seq);
+
+		if(_raw_hist_erased(oldest)) {
+			hist->erased--;
+		}
+		else {
+			if(hist->dups)
+				_raw_hist_dup_remove(hist, seq);
+			if(hist->grams)
+				_raw_grams_evict(hist, seq, oldest, _raw_hist_len(hist, oldest));
+			if(hist->sorted)
+				_raw_sorted_remove(hist, seq, oldest);
+		}
+
+		_raw_hist_drop(hist, oldest);
+	}
+
+	_raw_hist_at(hist, 0) = _raw_arena_add(hist, str, len);
+
+	if(hist->frecency) {
+		hist->frecency[(hist->count - 1) % hist->max].uses = uses + 1;
+		hist->frecency[(hist->count - 1) % hist->max].used = now;
+	}
+
+	/* update length */
+	hist->len++;
+	if(hist->len > hist->max)
+		hist->len = hist->max;
+
+	if(hist->dups)
+		_raw_hist_dup_add(hist, hist->count - 1);
+
+	if(hist->grams)
+		_raw_grams_add(hist, hist->count - 1, _raw_hist_at(hist, 0), len);
+
+	if(hist->sorted)
+		_raw_sorted_add(hist, hist->count - 1);
+
+	/* If the history is being browsed, keep the same item selected. If it was the oldest item and has just been
+	 * evicted, browsing stops (and its text is left on the line, as if it had been typed). */
+	if(hist->index >= 0 && ++hist->index >= hist->len) {
+		hist->index = -1;
+		raw->line->changed = true;
+	}
+
+	/* Once erased items take up most of the history, get rid of them. This renumbers the items, so it has to wait
+	 * until the history isn't being browsed. */
+	if(hist->erased * 2 > hist->len && hist->index < 0 && !hist->edits)
+		_raw_hist_compact(hist);
+
+	return true;
+} /* _raw_hist_add_len() */
+
+#define _raw_hist_add_str(raw, str) _raw_hist_add_len(raw, str, strlen(str))
+
+/* Edits made while browsing the history are kept in a small hash table, from the sequence number of the
+ * item (which, unlike its index, doesn't change when items are added) to the edited version of the item. */
+
+
+#define _raw_hist_hash(seq, size) (((unsigned) (seq) * 2654435761u) & ((size) - 1))
+
+static struct _raw_edit *_raw_hist_find_edit(struct _raw_hist *hist, int seq) {
+	if(!hist->edits)
+		return NULL;
+
+	/* linear probing, an empty bucket ends the search */
+	unsigned i = _raw_hist_hash(seq, hist->editsize);
+	while(hist->edits[i].seq >= 0) {
+		if(hist->edits[i].seq == seq)
+			return &hist->edits[i];
+		i = (i + 1) & (hist->editsize - 1);
+	}
+
+	return NULL;
+} /* _raw_hist_find_edit() */
+
+static void _raw_hist_put_edit(struct _raw_hist *hist, int seq, char *str) {
+	struct _raw_edit *edit = _raw_hist_find_edit(hist, seq);
+
+	/* replace an earlier edit of the same item */
+	if(edit) {
+		free(edit->str);
+		edit->str = str;
+		return;
+	}
+
+	/* grow the table, keeping it at most half full */
+	if((hist->editlen + 1) * 2 > hist->editsize) {
+		struct _raw_edit *old = hist->edits;
+		int i, oldsize = hist->editsize;
+
+		hist->editsize = oldsize ? oldsize * 2 : 8;
+		hist->edits = _raw_malloc(sizeof(struct _raw_edit) * hist->editsize);
+
+		for(i = 0; i < hist->editsize; i++) {
+			hist->edits[i].seq = -1;
+			hist->edits[i].str = NULL;
+		}
+
+		/* rehash the old edits */
+		hist->editlen = 0;
+		for(i = 0; i < oldsize; i++)
+			if(old[i].seq >= 0)
+				_raw_hist_put_edit(hist, old[i].seq, old[i].str);
+
+		free(old);
+	}
+
+	unsigned i = _raw_hist_hash(seq, hist->editsize);
+	while(hist->edits[i].seq >= 0)
+		i = (i + 1) & (hist->editsize - 1);
+
+	hist->edits[i].seq = seq;
+	hist->edits[i].str = str;
+	hist->editlen++;
+} /* _raw_hist_put_edit() */
+
+static char *_raw_hist_item(struct _raw_hist *hist, int index) {
+	struct _raw_edit *edit = _raw_hist_find_edit(hist, _raw_hist_seq(hist, index));
+
+	/* give the edited version of the item (if it has been edited) */
+	if(edit)
+		return edit->str;
+
+	return _raw_hist_get(hist, index);
+} /* _raw_hist_item() */
+
+#define _RAW_HIST_PREV 1
+#define _RAW_HIST_NEXT -1
+
+static void _raw_hist_keep(struct raw_t *raw) {
+	/* History items are shared between lines and never modified. If the line was changed, the original input
+	 * (or the edited history item) is saved before moving, and is thrown away when the line is finished. Moving
+	 * through items which weren't changed doesn't copy anything. */
+	if(raw->hist->index < 0) {
+		if(!raw->hist->original || raw->line->changed) {
+			free(raw->hist->original);
+			raw->hist->original = _raw_strdup(_raw_gap_str(raw->line->line));
+		}
+	}
+	else if(raw->line->changed) {
+		_raw_hist_put_edit(raw->hist, _raw_hist_seq(raw->hist, raw->hist->index), _raw_strdup(_raw_gap_str(raw->line->line)));
+	}
+} /* _raw_hist_keep() */
+
+static void _raw_hist_matches(struct _raw_hist *hist, char *prefix) {
+	free(hist->prefix);
+	hist->prefix = NULL;
+	hist->prefixlen = 0;
+
+	/* an empty line matches everything, which is just browsing the history */
+	if(!*prefix)
+		return;
+
+	if(!hist->sorted)
+		_raw_sorted_build(hist);
+
+	hist->prefix = _raw_strdup(prefix);
+	hist->prefixlen = strlen(prefix);
+} /* _raw_hist_matches() */
+
+static int _raw_hist_match(struct raw_t *raw, int move) {
+	struct _raw_hist *hist = raw->hist;
+	int i, seq = hist->index < 0 ? hist->count : _raw_hist_seq(hist, hist->index), oldest = hist->count - hist->len, best = -1;
+
+	/* there is nothing newer than the line being browsed from */
+	if(hist->index < 0 && move == _RAW_HIST_NEXT)
+		return -2;
+
+	/* The items starting with the prefix are together in the index, starting from the first item after it. The range
+	 * is found again for every move (the index can be merged while browsing), and the closest older (or newer) item
+	 * in it is the next match. */
+	int lo = _raw_sorted_find(hist, hist->prefix, -1);
+	int hi = _raw_sorted_bound(hist, hist->prefix, hist->prefixlen, 0, lo, hist->sortedlen);
+
+	for(i = lo; i < hi; i++) {
+		int match = hist->sorted[i];
+		if(match == _RAW_SORTED_HOLE)
+			continue;
+
+		if(move == _RAW_HIST_PREV ? match < seq && match > best : match > seq && (best < 0 || match < best))
+			best = match;
+	}
+
+	/* and any added items which haven't been sorted yet (skipping the ones erased or evicted since) */
+	for(i = 0; i < hist->pendinglen; i++) {
+		int match = hist->pending[i];
+		if(match < oldest || (move == _RAW_HIST_PREV ? match >= seq || match <= best : match <= seq || (best >= 0 && match >= best)))
+			continue;
+
+		char *item = _raw_hist_get_seq(hist, match);
+		if(!_raw_hist_erased(item) && !strncmp(item, hist->prefix, hist->prefixlen))
+			best = match;
+	}
+
+	/* past the latest match is the line being browsed from */
+	if(best < 0)
+		return move == _RAW_HIST_PREV ? -2 : -1;
+	return hist->count - 1 - best;
+} /* _raw_hist_match() */
+
+static int _raw_hist_move(struct raw_t *raw, int move) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->history, "raw_t history not enabled");
+
+	/* In prefix mode, browsing only goes through the items starting with the line being browsed from, which is
+	 * kept when browsing starts. */
+	if(raw->settings->prefix && raw->hist->index < 0 && move == _RAW_HIST_PREV)
+		_raw_hist_matches(raw->hist, _raw_gap_str(raw->line->line));
+
+	int index = raw->hist->index + move;
+	if(raw->hist->prefix) {
+		index = _raw_hist_match(raw, move);
+	}
+	else {
+		/* erased items are skipped over */
+		while(index >= 0 && index < raw->hist->len && _raw_hist_erased(_raw_hist_get(raw->hist, index)))
+			index += move;
+	}
+
+	/* movement is invalid if movement will be "out of bounds" on the array */
+	if(index < -1 || index >= raw->hist->len) {
+		/* browsing never started, so the prefix isn't needed */
+		if(raw->hist->index < 0)
+			_raw_hist_matches(raw->hist, "");
+		return BELL;
+	}
+
+	_raw_hist_keep(raw);
+	raw->hist->index = index;
+
+	if(raw->hist->index < 0)
+		/* get original line */
+		_raw_set_line(raw, raw->hist->original, 0);
+	else
+		/* move position and copy over the history entry */
+		_raw_set_line(raw, _raw_hist_item(raw->hist, raw->hist->index), 0);
+
+	raw->line->changed = false;
+
+	return SUCCESS;
+} /* _raw_hist_move() */
+
+static int _raw_suggestion(struct raw_t *raw, char **item, int *len) {
+	/* Nothing is suggested for an empty line, or while the history is being browsed. Suggestions are only shown with
+	 * the cursor at the end of the line, where typing keeps the gap, so looking one up doesn't move the gap. */
+	if(!raw->settings->suggest || !raw->line->suggesting || !raw->line->line->len || raw->hist->index >= 0)
+		return -1;
+
+	if(raw->line->cursor != raw->line->line->len)
+		return -1;
+
+	int seq = _raw_hist_suggest(raw->hist, _raw_gap_str(raw->line->line), raw->line->line->len);
+	if(seq >= 0) {
+		*item = _raw_hist_get_seq(raw->hist, seq);
+		*len = _raw_hist_len(raw->hist, *item);
+	}
+
+	return seq;
+} /* _raw_suggestion() */
+
+static int _raw_suggest_accept(struct raw_t *raw) {
+	int len = raw->line->line->len, end;
+	char *item;
+
+	if(_raw_suggestion(raw, &item, &end) < 0)
+		return SILENT;
+
+	/* add the rest of the suggested item to the end of the line */
+	raw->line->cursor = len;
+	return _raw_add_str(raw, item + len, end - len);
+} /* _raw_suggest_accept() */
+
+/* With frecency kept, items are serialised with their counters, as ": <last used>:<uses>;<item>" (like the extended
+ * history of zsh), and lines in that form are read back with their counters. */
+
+#define _RAW_FRECENCY_MAX 64 /* longest counters prefix (two longs and the punctuation) */
+
+static int _raw_frecency_out(struct _raw_hist *hist, int seq, char *buf) {
+	struct _raw_frecency *f = &hist->frecency[seq % hist->max];
+	return sprintf(buf, ": %ld:%d;", (long) f->used, _raw_uses(f));
+} /* _raw_frecency_out() */
+
+static bool _raw_frecency_num(char *str, int len, int *pos, long *num) {
+	int start = *pos;
+
+	/* read a number of at most 18 digits (so it can't overflow) */
+	for(*num = 0; *pos < len && *pos - start < 18 && str[*pos] >= '0' && str[*pos] <= '9'; (*pos)++)
+		*num = *num * 10 + (str[*pos] - '0');
+
+	return *pos > start;
+} /* _raw_frecency_num() */
+
+static int _raw_frecency_in(char *str, int len, struct _raw_frecency *f) {
+	long used, uses;
+	int pos = 2;
+
+	/* give the length of the counters at the start of the line (0 if the line doesn't start with them) */
+	if(len < 2 || str[0] != ':' || str[1] != ' ')
+		return 0;
+	if(!_raw_frecency_num(str, len, &pos, &used) || pos >= len || str[pos++] != ':')
+		return 0;
+	if(!_raw_frecency_num(str, len, &pos, &uses) || pos >= len || str[pos++] != ';' || uses > INT_MAX)
+		return 0;
+
+	f->used = used;
+	f->uses = uses;
+	return pos;
+} /* _raw_frecency_in() */
+
+static char *_raw_hist_to_serial(struct raw_t *raw) {
+	if(raw->hist->len == raw->hist->erased)
+		return NULL;
+
+	/* work out the size of the serialised history first, so it only needs one allocation */
+	char prefix[_RAW_FRECENCY_MAX];
+	int i, len = 0;
+	for(i = 0; i < raw->hist->len; i++) {
+		if(_raw_hist_erased(_raw_hist_get(raw->hist, i)))
+			continue;
+
+		len += _raw_hist_len(raw->hist, _raw_hist_at(raw->hist, i)) + 1;
+		if(raw->hist->frecency)
+			len += _raw_frecency_out(raw->hist, _raw_hist_seq(raw->hist, i), prefix);
+	}
+
+	char *ret = _raw_malloc(len);
+
+	len = 0;
+	for(i = 0; i < raw->hist->len; i++) {
+		if(_raw_hist_erased(_raw_hist_at(raw->hist, i)))
+			continue;
+
+		int itemlen = _raw_hist_len(raw->hist, _raw_hist_at(raw->hist, i));
+
+		if(raw->hist->frecency)
+			len += _raw_frecency_out(raw->hist, _raw_hist_seq(raw->hist, i), ret + len);
+
+		memcpy(ret + len, _raw_hist_at(raw->hist, i), itemlen);
+		len += itemlen + 1;
+		ret[len - 1] = '\n'; /* the seperator */
+	}
+
+	/* null terminate string */
+	ret[len - 1] = '\0';
+	return ret;
+} /* _raw_hist_to_serial() */
+
+static void _raw_hist_add_lines(struct raw_t *raw, char *str, int len) {
+	char *end = str + len;
+
+	/* add every (non-empty) line in place, without copying the string first */
+	while(str < end) {
+		char *nl = memchr(str, '\n', end - str);
+		if(!nl)
+			nl = end;
+
+		struct _raw_frecency f, latest = {0, 0};
+		int skip = raw->hist->frecency ? _raw_frecency_in(str, nl - str, &f) : 0;
+
+		if(nl > str + skip) {
+			if(skip && raw->hist->len)
+				latest = raw->hist->frecency[(raw->hist->count - 1) % raw->hist->max];
+
+			/* A consecutive duplicate isn't added, so its counters are added to the latest item's (which had it
+			 * counted as being used now). */
+			if(!_raw_hist_add_len(raw, str + skip, nl - str - skip) && skip) {
+				long uses = (long) _raw_uses(&latest) + _raw_uses(&f);
+
+				f.uses = uses > INT_MAX ? INT_MAX : uses;
+				if(latest.used > f.used)
+					f.used = latest.used;
+			}
+
+			/* the counters are given, so they replace the ones worked out when the item was added */
+			if(skip)
+				raw->hist->frecency[(raw->hist->count - 1) % raw->hist->max] = f;
+		}
+
+		str = nl + 1;
+	}
+} /* _raw_hist_add_lines() */
+
+static void _raw_hist_index(struct raw_t *raw) {
+	/* Index a loaded history up front, rather than on the first search or prefix lookup. An index which already
+	 * existed was kept up to date as the items were added. */
+	if(!raw->hist->grams)
+		_raw_grams_build(raw->hist);
+	if(!raw->hist->sorted && (raw->settings->prefix || raw->settings->suggest))
+		_raw_sorted_build(raw->hist);
+} /* _raw_hist_index() */
+
+static int _raw_hist_from_serial(struct raw_t *raw, char *str) {
+	/* no string given */
+	if(!str)
+		return -1;
+
+	/* eradicate the old history. */
+	int max = raw->hist->max - 1;
+	_raw_hist_free(raw->hist);
+	free(raw->hist);
+
+	/* get length of serialised history */
+	int len = _raw_strnchr(str, '\n') + 1;
+
+	/* length is upper limit */
+	if(len > max)
+		max = len;
+
+	/* make a new history */
+	raw->hist = _raw_hist_new(max);
+	if(raw->settings->frecency)
+		raw->hist->frecency = _raw_calloc(raw->hist->max, sizeof(struct _raw_frecency));
+
+	/* fill up the history with the lines, and index them */
+	_raw_hist_add_lines(raw, str, strlen(str));
+	_raw_hist_index(raw);
+	return 0;
+} /* _raw_hist_from_serial() */
+
+/* History can also be streamed to and from a file, one item per line (from the oldest item to the latest, so
+ * loading a saved history gives the same history). Both directions go through a fixed size buffer, so saving or
+ * loading never needs more memory than the history itself. */
+
+#define _RAW_HIST_CHUNK 65536
+
+static int _raw_hist_flush(struct _raw_buf *buf, int fd, FILE *file) {
+	int done = 0;
+
+	if(file) {
+		done = fwrite(buf->buf, 1, buf->len, file);
+	}
+	else {
+		while(done < buf->len) {
+			int ret = write(fd, buf->buf + done, buf->len - done);
+
+			if(ret < 0) {
+				if(errno == EINTR)
+					continue;
+				break;
+			}
+
+			done += ret;
+		}
+	}
+
+	if(done < buf->len)
+		return -1;
+
+	buf->len = 0;
+	return 0;
+} /* _raw_hist_flush() */
+
+/* saves the history, one item per line (with the frecency counters of each item if counters is set) */
+static int _raw_hist_save(struct raw_t *raw, int fd, FILE *file, bool counters) {
+	struct _raw_buf *buf = _raw_buf_new(_RAW_HIST_CHUNK);
+	char prefix[_RAW_FRECENCY_MAX];
+	int i, ret = 0, plen = 0;
+
+	for(i = raw->hist->len - 1; i >= 0 && !ret; i--) {
+		char *item = _raw_hist_get(raw->hist, i);
+		if(_raw_hist_erased(item))
+			continue;
+
+		int len = _raw_hist_len(raw->hist, item);
+		if(counters)
+			plen = _raw_frecency_out(raw->hist, _raw_hist_seq(raw->hist, i), prefix);
+
+		/* write out the buffer when the next item doesn't fit (it grows to fit items bigger than itself) */
+		if(buf->len + plen + len + 1 > buf->size)
+			ret = _raw_hist_flush(buf, fd, file);
+
+		_raw_buf_add(buf, prefix, plen);
+		_raw_buf_add(buf, item, len);
+		_raw_buf_add(buf, "\n", 1);
+	}
+
+	if(!ret)
+		ret = _raw_hist_flush(buf, fd, file);
+
+	if(!ret && file)
+		ret = fflush(file) ? -1 : 0;
+
+	_raw_buf_free(buf);
+	return ret;
+} /* _raw_hist_save() */
+
+static int _raw_hist_load(struct raw_t *raw, int fd, FILE *file) {
+	struct _raw_buf *buf = _raw_buf_new(_RAW_HIST_CHUNK);
+	int ret = 0;
+
+	while(true) {
+		/* make sure there is always a chunk's worth of space after any partial line */
+		if(buf->size - buf->len < _RAW_HIST_CHUNK) {
+			buf->size *= 2;
+			buf->buf = _raw_realloc(buf->buf, buf->size);
+		}
+
+		int len;
+		if(file)
+			len = fread(buf->buf + buf->len, 1, _RAW_HIST_CHUNK, file);
+		else
+			len = read(fd, buf->buf + buf->len, _RAW_HIST_CHUNK);
+
+		if(len < 0 && errno == EINTR)
+			continue;
+
+		if(len < 0 || (file && !len && ferror(file))) {
+			ret = -1;
+			break;
+		}
+
+		/* end of file, add whatever is left */
+		if(!len) {
+			_raw_hist_add_lines(raw, buf->buf, buf->len);
+			break;
+		}
+
+		/* find the end of the last complete line in the new chunk */
+		char *start = buf->buf + buf->len, *end = start + len, *last = end;
+		while(last > start && last[-1] != '\n')
+			last--;
+
+		buf->len += len;
+		if(last == start)
+			continue;
+
+		/* add all of the complete lines, and keep the partial line for the next chunk */
+		_raw_hist_add_lines(raw, buf->buf, last - buf->buf);
+
+		buf->len = end - last;
+		memmove(buf->buf, last, buf->len);
+	}
+
+	_raw_buf_free(buf);
+	_raw_hist_index(raw);
+	return ret;
+} /* _raw_hist_load() */
+
+/* Indexed history files can be mapped and used in place, so loading them doesn't copy or parse any of the items
+ * (and processes mapping the same file share its pages). The file is a header, followed by the offset of each item
+ * from the start of the file and then the items themselves (NUL terminated), from the oldest item to the latest.
+ * Everything is in the byte order of the machine which wrote the file. */
+
+#define _RAW_HIST_MAGIC "RAWH"
+#define _RAW_HIST_VERSION 1
+
+struct _raw_hist_header {
+	char magic[4]; /* _RAW_HIST_MAGIC */
+	uint32_t version; /* _RAW_HIST_VERSION */
+	uint32_t count; /* number of items in the file */
+};
+
+static int _raw_hist_save_index(struct raw_t *raw, int fd) {
+	struct _raw_hist *hist = raw->hist;
+	struct _raw_hist_header header;
+	int i, ret = 0;
+
+	/* offsets are 32 bits, so make sure the file will fit before writing anything */
+	size_t size = sizeof(header) + sizeof(uint32_t) * (hist->len - hist->erased);
+	for(i = 0; i < hist->len; i++)
+		if(!_raw_hist_erased(_raw_hist_get(hist, i)))
+			size += _raw_hist_len(hist, _raw_hist_at(hist, i)) + 1;
+
+	if(size > UINT32_MAX)
+		return -1;
+
+	memcpy(header.magic, _RAW_HIST_MAGIC, sizeof(header.magic));
+	header.version = _RAW_HIST_VERSION;
+	header.count = hist->len - hist->erased;
+
+	struct _raw_buf *buf = _raw_buf_new(_RAW_HIST_CHUNK);
+	_raw_buf_add(buf, (char *) &header, sizeof(header));
+
+	/* the index */
+	uint32_t off = sizeof(header) + sizeof(uint32_t) * header.count;
+	for(i = hist->len - 1; i >= 0 && !ret; i--) {
+		if(_raw_hist_erased(_raw_hist_at(hist, i)))
+			continue;
+
+		if(buf->len + (int) sizeof(off) > buf->size)
+			ret = _raw_hist_flush(buf, fd, NULL);
+
+		_raw_buf_add(buf, (char *) &off, sizeof(off));
+		off += _raw_hist_len(hist, _raw_hist_get(hist, i)) + 1;
+	}
+
+	/* the items */
+	for(i = hist->len - 1; i >= 0 && !ret; i--) {
+		char *item = _raw_hist_get(hist, i);
+		if(_raw_hist_erased(item))
+			continue;
+
+		int len = _raw_hist_len(hist, item) + 1;
+
+		if(buf->len + len > buf->size)
+			ret = _raw_hist_flush(buf, fd, NULL);
+
+		_raw_buf_add(buf, item, len);
+	}
+
+	if(!ret)
+		ret = _raw_hist_flush(buf, fd, NULL);
+
+	_raw_buf_free(buf);
+	return ret;
+} /* _raw_hist_save_index() */
+
+static int _raw_hist_map(struct raw_t *raw, int fd) {
+	struct _raw_hist_header header;
+	struct stat st;
+
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(header) || st.st_size > UINT32_MAX)
+		return -1;
+
+	size_t size = st.st_size;
+	char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED)
+		return -1;
+
+	/* check the header and that the index fits, and make sure every item is terminated */
+	memcpy(&header, map, sizeof(header));
+	if(memcmp(header.magic, _RAW_HIST_MAGIC, sizeof(header.magic)) || header.version != _RAW_HIST_VERSION
+		|| header.count > (size - sizeof(header)) / sizeof(uint32_t) || (header.count && map[size - 1] != '\0')) {
+		munmap(map, size);
+		return -1;
+	}
+
+	/* eradicate the old history, and replace it with the (as yet untouched) items in the mapping */
+	int max = raw->hist->max - 1;
+	_raw_hist_free(raw->hist);
+	free(raw->hist);
+
+	raw->hist = _raw_hist_new(max);
+	if(raw->settings->frecency)
+		raw->hist->frecency = _raw_calloc(raw->hist->max, sizeof(struct _raw_frecency));
+
+	raw->hist->map = map;
+	raw->hist->mapsize = size;
+	raw->hist->mapindex = (uint32_t *) (map + sizeof(header));
+	raw->hist->mapcount = header.count;
+
+	raw->hist->count = header.count;
+	raw->hist->len = header.count < (uint32_t) raw->hist->max ? (int) header.count : raw->hist->max;
+
+	/* index the items (which reads all of them in) */
+	_raw_hist_index(raw);
+
+	return 0;
+} /* _raw_hist_map() */
+
+/* == History Journal == */
+
+/* A journal is a history file (one item per line) which is shared by every instance using it. Items added to the
+ * history are appended to it as they are added, and items appended by other instances are picked up incrementally
+ * by reading from where the last read finished. Items appended by this instance are already in the history, so
+ * where each of them starts is remembered, and they are skipped when they are read back. */
+
+static void _raw_journal_sync(struct _raw_journal *journal) {
+	if(journal->unsynced) {
+		fsync(journal->fd);
+		journal->unsynced = 0;
+	}
+} /* _raw_journal_sync() */
+
+static void _raw_journal_free(struct _raw_journal *journal) {
+	_raw_journal_sync(journal);
+	close(journal->fd);
+
+	free(journal->own);
+	free(journal->path);
+	free(journal);
+} /* _raw_journal_free() */
+
+static void _raw_journal_add(struct raw_t *raw, char *str) {
+	struct _raw_journal *journal = raw->journal;
+	int len = strlen(str);
+
+	/* the item is written with a single write(2), so that appends from other instances can't end up inside it */
+	char *record = _raw_malloc(len + 1);
+	memcpy(record, str, len);
+	record[len] = '\n';
+
+	int ret;
+	do {
+		ret = write(journal->fd, record, len + 1);
+	} while(ret < 0 && errno == EINTR);
+
+	free(record);
+
+	/* the item stays in the history even if it couldn't be written */
+	if(ret != len + 1)
+		return;
+
+	/* with O_APPEND, the file offset is left at the end of the item which was just written */
+	if(journal->ownlen == journal->ownsize) {
+		journal->ownsize = journal->ownsize ? journal->ownsize * 2 : 8;
+		journal->own = _raw_realloc(journal->own, sizeof(off_t) * journal->ownsize);
+	}
+
+	journal->own[journal->ownlen++] = lseek(journal->fd, 0, SEEK_CUR) - (len + 1);
+
+	/* batch up fsync(2)s */
+	journal->unsynced++;
+	if(journal->sync && journal->unsynced >= journal->sync)
+		_raw_journal_sync(journal);
+} /* _raw_journal_add() */
+
+static int _raw_journal_update(struct raw_t *raw) {
+	struct _raw_journal *journal = raw->journal;
+	struct stat st;
+
+	if(fstat(journal->fd, &st) < 0)
+		return -1;
+
+	/* nothing has been appended since the last read */
+	if(st.st_size <= journal->offset)
+		return 0;
+
+	struct _raw_buf *buf = _raw_buf_new(_RAW_HIST_CHUNK);
+	int own = 0, ret = 0;
+
+	while(journal->offset + buf->len < st.st_size) {
+		/* make sure there is always a chunk's worth of space after any partial line */
+		if(buf->size - buf->len < _RAW_HIST_CHUNK) {
+			buf->size *= 2;
+			buf->buf = _raw_realloc(buf->buf, buf->size);
+		}
+
+		int len = pread(journal->fd, buf->buf + buf->len, _RAW_HIST_CHUNK, journal->offset + buf->len);
+
+		if(len < 0 && errno == EINTR)
+			continue;
+
+		if(len <= 0) {
+			ret = len;
+			break;
+		}
+
+		/* add each complete line (an incomplete line is still being written, so it is left for the next read) */
+		char *str = buf->buf, *end = buf->buf + buf->len + len, *nl;
+		while((nl = memchr(str, '\n', end - str))) {
+			off_t pos = journal->offset + (str - buf->buf);
+
+			/* skip the items appended by this instance */
+			if(own < journal->ownlen && journal->own[own] == pos)
+				own++;
+			else if(nl > str)
+				_raw_hist_add_len(raw, str, nl - str);
+
+			str = nl + 1;
+		}
+
+		journal->offset += str - buf->buf;
+		buf->len = end - str;
+		memmove(buf->buf, str, buf->len);
+	}
+
+	/* forget about the items which have been passed */
+	journal->ownlen -= own;
+	memmove(journal->own, journal->own + own, sizeof(off_t) * journal->ownlen);
+
+	_raw_buf_free(buf);
+	return ret;
+} /* _raw_journal_update() */
+
+static int _raw_journal_open(struct raw_t *raw, char *path, int sync) {
+	/* the history is private */
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+	if(fd < 0)
+		return -1;
+
+	struct _raw_journal *journal = _raw_malloc(sizeof(struct _raw_journal));
+
+	journal->path = _raw_strdup(path);
+	journal->fd = fd;
+	journal->offset = 0;
+	journal->sync = sync;
+	journal->unsynced = 0;
+	journal->own = NULL;
+	journal->ownlen = 0;
+	journal->ownsize = 0;
+
+	raw->journal = journal;
+
+	/* read in the whole journal, and index it */
+	int ret = _raw_journal_update(raw);
+	_raw_hist_index(raw);
+
+	/* whatever was read stays in the history, but the journal isn't used */
+	if(ret < 0) {
+		_raw_journal_free(journal);
+		raw->journal = NULL;
+	}
+
+	return ret;
+} /* _raw_journal_open() */
+
+static int _raw_journal_compact(struct raw_t *raw) {
+	struct _raw_journal *journal = raw->journal;
+
+	/* get everything which has been appended, so nothing is lost */
+	if(_raw_journal_update(raw) < 0)
+		return -1;
+
+	int len = strlen(journal->path);
+	char *tmp = _raw_malloc(len + 5);
+	memcpy(tmp, journal->path, len);
+	memcpy(tmp + len, ".tmp", 5);
+
+	/* write the history (which only has the latest items) to a new file, and replace the journal with it */
+	int ret = -1, fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if(fd >= 0) {
+		/* the journal only holds plain items (they are read back verbatim) */
+		ret = _raw_hist_save(raw, fd, NULL, false);
+
+		if(!ret)
+			ret = fsync(fd);
+
+		close(fd);
+
+		if(!ret)
+			ret = rename(tmp, journal->path);
+
+		if(ret)
+			unlink(tmp);
+	}
+
+	free(tmp);
+
+	if(ret)
+		return -1;
+
+	/* switch over to the new journal, which is already in the history */
+	fd = open(journal->path, O_RDWR | O_APPEND);
+	if(fd < 0)
+		return -1;
+
+	close(journal->fd);
+	journal->fd = fd;
+	journal->offset = lseek(fd, 0, SEEK_END);
+	journal->unsynced = 0;
+	journal->ownlen = 0;
+
+	return 0;
+} /* _raw_journal_compact() */
+
+/* == Completion == */
+
+/* With caching enabled, the candidates from the callback are kept after a tab press. Candidates for a longer input
+ * are a subset of them, so while the input still starts with the input they were given for (and they haven't
+ * expired), the cached candidates are narrowed down in place instead of calling the callback again. */
+
+static void _raw_comp_forget(struct _raw_comp *comp) {
+	int i;
+
+	for(i = 0; i < comp->cachelen; i++)
+		free(comp->cache[i]);
+	free(comp->cache);
+	free(comp->cachekey);
+
+	comp->cache = NULL;
+	comp->cachelen = 0;
+	comp->cachekey = NULL;
+} /* _raw_comp_forget() */
+
+static char **_raw_comp_cached(struct _raw_comp *comp, char *str) {
+	int i, len = 0, keylen = strlen(comp->cachekey), lenstr = strlen(str);
+
+	if(lenstr < keylen || strncmp(str, comp->cachekey, keylen) || (comp->ttl && time(NULL) - comp->cachetime >= comp->ttl)) {
+		_raw_comp_forget(comp);
+		return NULL;
+	}
+
+	/* every candidate starts with the key, so only the rest of the input has to be compared */
+	for(i = 0; i < comp->cachelen; i++) {
+		if(!strncmp(comp->cache[i] + keylen, str + keylen, lenstr - keylen))
+			comp->cache[len++] = comp->cache[i];
+		else
+			free(comp->cache[i]);
+	}
+
+	comp->cache[len] = NULL;
+	comp->cachelen = len;
+
+	free(comp->cachekey);
+	comp->cachekey = _raw_strdup(str);
+	return comp->cache;
+} /* _raw_comp_cached() */
+
+static char **_raw_comp_filter(struct raw_t *raw, char *str) {
+	assert(raw->safe, "raw_t structure not allocated");
 	assert(raw->settings->completion, "raw_t completion not enabled");
 	assert(raw->comp->callback, "raw_t completion callback not defined");
 
-	/* get search table */
-	char **table = raw->comp->callback(str);
-	char **search = NULL;
+	if(raw->comp->cache) {
+		char **cached = _raw_comp_cached(raw->comp, str);
+		if(cached)
+			return cached;
+	}
+
+	/* get search table */
+	char **table = raw->comp->callback(str);
+	char **search = NULL;
+	int i, searchlen = 0, lenstr = strlen(str);
+
+	/* no table means no candidates (which are still cached, so longer inputs don't call callback() either) */
+	if(!table && !raw->settings->compcache)
+		return NULL;
+
+	/* filter table with string */
+	for(i = 0; table && table[i] != NULL; i++) {
+		/* valid entries for consideration must start with input string */
+		if(!strncmp(str, table[i], lenstr)) {
+			searchlen++;
+
+			/* append the string to the search table */
+			search = _raw_realloc(search, searchlen * sizeof(char *));
+			search[searchlen - 1] = _raw_strdup(table[i]);
+		}
+	}
+
+	/* null terminate search table */
+	search = _raw_realloc(search, ++searchlen * sizeof(char *));
+	search[searchlen - 1] = NULL;
+
+	/* call cleanup function (if defined) */
+	if(table && raw->comp->cleanup)
+		raw->comp->cleanup(table);
+
+	/* keep the candidates for the next tab press */
+	if(raw->settings->compcache) {
+		raw->comp->cache = search;
+		raw->comp->cachelen = searchlen - 1;
+		raw->comp->cachekey = _raw_strdup(str);
+		raw->comp->cachetime = time(NULL);
+	}
+
+	return search;
+} /* _raw_comp_filter() */
+
+static char *_raw_comp_get(struct raw_t *raw, char *str) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->completion, "raw_t completion not enabled");
+
+	char **search = _raw_comp_filter(raw, str);
+
+	/* no matches (cached candidates are kept for the next tab press) */
+	if(!search || !search[0]) {
+		if(search && search != raw->comp->cache) {
+			int i;
+			for(i = 0; search[i] != NULL; i++)
+				free(search[i]);
+			free(search);
+		}
+
+		return NULL;
+	}
+
+	/* output comparison */
+	char *comp = NULL;
+	bool same = true;
+	int complen = 0, j = 0;
+
+
+	/* Get the largest common "prefix" for the entire search table. This
+	 * is to mimic the bash-like completion, where the longest common prefix
+	 * is matched, and the rest is left to the user. */
+
+	do {
+		char ch = search[0][j];
+
+		/* add current char to */
+		comp = _raw_realloc(comp, complen + 1);
+		comp[complen] = ch;
+		complen++;
+
+		/* Check if the character in that position is the same in every item in
+		 * the search table. If so, we can use it in the chosen input. */
+		int i;
+		for(i = 1; search[i] != NULL && same; i++)
+			if(ch != search[i][j])
+				same = false;
+
+		/* quit if we hit the null terminator */
+		if(ch == '\0')
+			break;
+
+		j++;
+	} while(same);
+
+	/* null terminate */
+	comp[complen - 1] = '\0';
+
+	/* clean up search table (unless it's cached) */
+	if(search != raw->comp->cache) {
+		int i;
+		for(i = 0; search[i] != NULL; i++)
+			free(search[i]);
+		free(search);
+	}
+
+	/* give prefix */
+	return comp;
+} /* _raw_comp_get() */
+
+/* A registered corpus is copied and sorted once, so the candidates for any input are a range of it. The range is
+ * found with a binary search which skips the bytes already known to match (every item between two items shares
+ * their common prefix with the input), and the common prefix of a sorted range is the common prefix of its first
+ * and last items. */
+
+static int _raw_corpus_cmp(const void *a, const void *b) {
+	return strcmp(*(char **) a, *(char **) b);
+} /* _raw_corpus_cmp() */
+
+static struct _raw_comp *_raw_comp_new(void) {
+	struct _raw_comp *comp = _raw_malloc(sizeof(struct _raw_comp));
+
+	comp->callback = NULL;
+	comp->cleanup = NULL;
+
+	comp->cache = NULL;
+	comp->cachelen = 0;
+	comp->cachekey = NULL;
+	comp->ttl = 0;
+
+	comp->corpus = NULL;
+	comp->corpuslen = 0;
+	comp->corpusbuf = NULL;
+
+	comp->stream = NULL;
+	comp->emitting = false;
+	comp->emitbuf = NULL;
+	comp->emitsize = 0;
+
+	comp->providers = NULL;
+	comp->nproviders = 0;
+	comp->pool = NULL;
+	comp->async = NULL;
+	return comp;
+} /* _raw_comp_new() */
+
+static void _raw_corpus_free(struct _raw_comp *comp) {
+	free(comp->corpus);
+	free(comp->corpusbuf);
+
+	comp->corpus = NULL;
+	comp->corpuslen = 0;
+	comp->corpusbuf = NULL;
+} /* _raw_corpus_free() */
+
+static void _raw_comp_cancel(struct raw_t *);
+static void _raw_pool_free(struct _raw_pool *);
+
+static void _raw_comp_free(struct raw_t *raw) {
+	struct _raw_comp *comp = raw->comp;
+
+	if(comp->pool) {
+		_raw_comp_cancel(raw);
+		_raw_pool_free(comp->pool);
+	}
+
+	_raw_comp_forget(comp);
+	_raw_corpus_free(comp);
+	free(comp->emitbuf);
+	free(comp->providers);
+	free(comp);
+
+	raw->comp = NULL;
+	raw->settings->compcache = false;
+	raw->settings->comppool = false;
+	raw->settings->compasync = false;
+} /* _raw_comp_free() */
+
+/* frees the completion data once there is nothing left to complete from */
+static void _raw_comp_update(struct raw_t *raw) {
+	struct _raw_comp *comp = raw->comp;
+
+	if(comp && !comp->callback && !comp->corpus && !comp->stream && !comp->providers)
+		_raw_comp_free(raw);
+
+	raw->settings->completion = BOOL(raw->comp);
+} /* _raw_comp_update() */
+
+static void _raw_corpus_build(struct _raw_comp *comp, char **corpus) {
+	int i, len = 0, size = 0;
+
+	for(len = 0; corpus[len] != NULL; len++)
+		size += strlen(corpus[len]) + 1;
+
+	/* copy every item into one buffer (so the caller can free the corpus) */
+	comp->corpus = _raw_malloc((len + 1) * sizeof(char *));
+	comp->corpusbuf = _raw_malloc(size + 1);
+	comp->corpuslen = len;
+
+	for(i = 0, size = 0; i < len; i++) {
+		int itemlen = strlen(corpus[i]) + 1;
+
+		memcpy(comp->corpusbuf + size, corpus[i], itemlen);
+		comp->corpus[i] = comp->corpusbuf + size;
+		size += itemlen;
+	}
+
+	comp->corpus[len] = NULL;
+	qsort(comp->corpus, len, sizeof(char *), _raw_corpus_cmp);
+} /* _raw_corpus_build() */
+
+/* find the first item of the corpus which doesn't come before str (or, if after is set, which comes after str), only
+ * comparing the first len bytes of items */
+static int _raw_corpus_bound(struct _raw_comp *comp, char *str, int len, bool after) {
+	int lo = 0, hi = comp->corpuslen, lolcp = 0, hilcp = 0;
+
+	while(lo < hi) {
+		int mid = lo + (hi - lo) / 2, cmp = 0;
+		char *item = comp->corpus[mid];
+
+		/* item shares (at least) the smaller of the common prefixes of the bounds with str */
+		int i = lolcp < hilcp ? lolcp : hilcp;
+		while(i < len && item[i] == str[i])
+			i++;
+
+		if(i < len)
+			cmp = (unsigned char) item[i] - (unsigned char) str[i];
+
+		if(cmp < 0 || (after && !cmp)) {
+			lo = mid + 1;
+			lolcp = i;
+		}
+		else {
+			hi = mid;
+			hilcp = i;
+		}
+	}
+
+	return lo;
+} /* _raw_corpus_bound() */
+
+/* returns the first item of the corpus starting with str (and sets *complen to the length of the common prefix of
+ * every such item), or NULL if no item starts with str */
+static char *_raw_corpus_get(struct _raw_comp *comp, char *str, int len, int *complen) {
+	int lo = _raw_corpus_bound(comp, str, len, false);
+	int hi = _raw_corpus_bound(comp, str, len, true);
+
+	if(lo == hi)
+		return NULL;
+
+	char *first = comp->corpus[lo], *last = comp->corpus[hi - 1];
+	int i = len;
+
+	while(first[i] && first[i] == last[i])
+		i++;
+
+	*complen = i;
+	return first;
+} /* _raw_corpus_get() */
+
+static int _raw_comp_common(char *a, char *b, int from, int len) {
+	while(from < len && a[from] == b[from])
+		from++;
+
+	return from;
+} /* _raw_comp_common() */
+
+/* A stream hands over its candidates one at a time with raw_comp_emit(), so they are never copied (apart from the
+ * bytes of the first one, as the candidates themselves belong to the stream). Only the length of the common prefix
+ * of the candidates is kept, which can only get shorter, so once it is as short as the input nothing can extend the
+ * input anymore and the stream is told to stop. */
+
+static void _raw_comp_emit(struct _raw_comp *comp, char *candidate) {
+	int i = comp->emitinputlen;
+
+	/* the first candidate is the common prefix so far */
+	if(!comp->emitprefix) {
+		int len = strlen(candidate);
+
+		if(comp->emitsize < len + 1) {
+			comp->emitsize = len + 1;
+			comp->emitbuf = _raw_realloc(comp->emitbuf, comp->emitsize);
+		}
+
+		memcpy(comp->emitbuf, candidate, len + 1);
+		comp->emitprefix = comp->emitbuf;
+		comp->emitlen = len;
+		return;
+	}
+
+	comp->emitlen = _raw_comp_common(comp->emitprefix, candidate, i, comp->emitlen);
+} /* _raw_comp_emit() */
+
+/* Providers are run on a small pool of worker threads, so a tab press takes as long as the slowest provider rather
+ * than all of them. Each job works out the common prefix of its provider's candidates, and merges it into the
+ * request. The input thread waits for the jobs until the deadline (or until the common prefix can't extend the
+ * input anymore), and uses whatever has arrived by then. Jobs which are still running are left to finish on their
+ * own, and their results are thrown away. */
+
+/* returns a copy of the common prefix of every candidate from provider starting with str (and sets *complen to its
+ * length), or NULL if there aren't any */
+static char *_raw_provider_get(struct _raw_provider *provider, char *str, int len, int *complen) {
+	char **table = provider->callback(str), *first = NULL, *prefix = NULL;
+	int i, n = 0;
+
+	for(i = 0; table && table[i] != NULL; i++) {
+		/* valid candidates must start with the input */
+		if(strncmp(table[i], str, len))
+			continue;
+
+		if(!first) {
+			first = table[i];
+			n = strlen(first);
+		}
+		else {
+			n = _raw_comp_common(first, table[i], len, n);
+		}
+	}
+
+	if(first) {
+		prefix = _raw_malloc(n + 1);
+		memcpy(prefix, first, n);
+		prefix[n] = '\0';
+		*complen = n;
+	}
+
+	if(table && provider->cleanup)
+		provider->cleanup(table);
+
+	return prefix;
+} /* _raw_provider_get() */
+
+static void _raw_deadline(struct timespec *deadline, int timeout) {
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000L;
+
+	if(deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+} /* _raw_deadline() */
+
+/* the request is seeded with the common prefix of the candidates from the other sources (if there are any) */
+static struct _raw_req *_raw_req_new(char *str, int len, char *prefix, int complen, int pending) {
+	struct _raw_req *req = _raw_malloc(sizeof(struct _raw_req));
+
+	req->input = _raw_strdup(str);
+	req->len = len;
+	req->pending = pending;
+	req->abandoned = false;
+	req->async = false;
+	req->prefix = NULL;
+	req->complen = 0;
+
+	if(prefix) {
+		req->prefix = _raw_malloc(complen + 1);
+		memcpy(req->prefix, prefix, complen);
+		req->prefix[complen] = '\0';
+		req->complen = complen;
+	}
+
+	return req;
+} /* _raw_req_new() */
+
+static void _raw_req_free(struct _raw_req *req) {
+	free(req->input);
+	free(req->prefix);
+	free(req);
+} /* _raw_req_free() */
+
+/* merges the common prefix of a provider's candidates into the request (taking ownership of it) */
+static void _raw_req_merge(struct _raw_req *req, char *prefix, int complen) {
+	if(!prefix)
+		return;
+
+	if(!req->prefix) {
+		req->prefix = prefix;
+		req->complen = complen;
+		return;
+	}
+
+	req->complen = _raw_comp_common(req->prefix, prefix, req->len, complen < req->complen ? complen : req->complen);
+	free(prefix);
+} /* _raw_req_merge() */
+
+/* is every provider done (or can nothing extend the input anymore)? */
+static bool _raw_req_ready(struct _raw_req *req) {
+	return !req->pending || (req->prefix && req->complen == req->len);
+} /* _raw_req_ready() */
+
+static bool _raw_req_expired(struct _raw_pool *pool, struct _raw_req *req) {
+	struct timespec now;
+
+	if(!pool->deadline)
+		return false;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec > req->deadline.tv_sec || (now.tv_sec == req->deadline.tv_sec && now.tv_nsec >= req->deadline.tv_nsec);
+} /* _raw_req_expired() */
+
+/* stops waiting for the request, leaving it to the last running job to finish (the pool must be locked) */
+static void _raw_req_drop(struct _raw_pool *pool, struct _raw_req *req) {
+	struct _raw_job **job = &pool->head, *last = NULL;
+
+	/* the jobs which haven't started yet are dropped straight away */
+	while(*job) {
+		if((*job)->req != req) {
+			last = *job;
+			job = &(*job)->next;
+			continue;
+		}
+
+		struct _raw_job *dropped = *job;
+		*job = dropped->next;
+		free(dropped);
+		req->pending--;
+	}
+
+	pool->tail = last;
+
+	if(req->pending)
+		req->abandoned = true;
+	else
+		_raw_req_free(req);
+} /* _raw_req_drop() */
+
+/* marks one of the request's jobs as finished (the pool must be locked) */
+static void _raw_req_finish(struct _raw_pool *pool, struct _raw_req *req) {
+	req->pending--;
+
+	if(req->abandoned) {
+		if(!req->pending)
+			_raw_req_free(req);
+		return;
+	}
+
+	/* the wake pipe is non-blocking, and a full pipe will wake the input thread anyway */
+	if(req->async && _raw_req_ready(req) && write(pool->wake[1], "", 1) < 0)
+		errno = 0;
+
+	pthread_cond_broadcast(&pool->done);
+} /* _raw_req_finish() */
+
+static void _raw_pool_destroy(struct _raw_pool *pool) {
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+
+	close(pool->wake[0]);
+	close(pool->wake[1]);
+	free(pool);
+} /* _raw_pool_destroy() */
+
+static void *_raw_pool_work(void *arg) {
+	struct _raw_pool *pool = arg;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while(true) {
+		while(!pool->head && !pool->stop)
+			pthread_cond_wait(&pool->work, &pool->lock);
+
+		/* jobs left in the queue are dropped by _raw_pool_free() */
+		if(pool->stop)
+			break;
+
+		struct _raw_job *job = pool->head;
+		pool->head = job->next;
+		if(!pool->head)
+			pool->tail = NULL;
+
+		/* nobody is waiting for the request anymore, so the provider isn't worth running */
+		if(job->req->abandoned) {
+			_raw_req_finish(pool, job->req);
+			free(job);
+			continue;
+		}
+
+		/* the input of a request doesn't change, so the provider can be called without the lock */
+		pthread_mutex_unlock(&pool->lock);
+
+		int complen = 0;
+		char *prefix = _raw_provider_get(&job->provider, job->req->input, job->req->len, &complen);
+
+		pthread_mutex_lock(&pool->lock);
+
+		_raw_req_merge(job->req, prefix, complen);
+		_raw_req_finish(pool, job->req);
+		free(job);
+	}
+
+	/* the pool has been freed by its owner, so the last worker out gets rid of it */
+	bool last = !--pool->nthreads;
+	pthread_mutex_unlock(&pool->lock);
+
+	if(last)
+		_raw_pool_destroy(pool);
+
+	return NULL;
+} /* _raw_pool_work() */
+
+/* A provider can take as long as it likes, so freeing the pool doesn't wait for the workers. Every request has been
+ * dropped by now, so running providers only finish their (abandoned) jobs, and the workers exit once they see that
+ * the pool is being stopped. Whoever is last (the owner or the last worker) frees the pool. */
+static void _raw_pool_free(struct _raw_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+
+	/* drop the jobs which never ran */
+	while(pool->head) {
+		struct _raw_job *job = pool->head;
+		pool->head = job->next;
+
+		_raw_req_finish(pool, job->req);
+		free(job);
+	}
+
+	pool->tail = NULL;
+	pthread_cond_broadcast(&pool->work);
 
-	if(!table)
+	bool last = !pool->nthreads;
+	pthread_mutex_unlock(&pool->lock);
+
+	if(last)
+		_raw_pool_destroy(pool);
+} /* _raw_pool_free() */
+
+static struct _raw_pool *_raw_pool_new(int threads, int deadline) {
+	struct _raw_pool *pool;
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+	int wake[2];
+
+	if(pipe(wake) < 0)
 		return NULL;
 
-	/* filter table with string */
-	int i, searchlen = 0, lenstr = strlen(str);
-	for(i = 0; table[i] != NULL; i++) {
-		/* valid entries for consideration must start with input string */
-		if(!strncmp(str, table[i], lenstr)) {
-			searchlen++;
+	/* neither end of the wake pipe may block (or be inherited by children) */
+	fcntl(wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake[1], F_SETFL, O_NONBLOCK);
+	fcntl(wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(wake[1], F_SETFD, FD_CLOEXEC);
 
-			/* append the string to the search table */
-			search = _raw_realloc(search, searchlen * sizeof(char *));
-			search[searchlen - 1] = _raw_strdup(table[i]);
+	pool = _raw_malloc(sizeof(struct _raw_pool));
+	pool->wake[0] = wake[0];
+	pool->wake[1] = wake[1];
+
+	pool->nthreads = 0;
+	pool->deadline = deadline;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->head = pool->tail = NULL;
+	pool->stop = false;
+
+	/* signals (like SIGWINCH) are left to the input thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	/* the workers can't touch the pool until it is unlocked */
+	pthread_mutex_lock(&pool->lock);
+
+	while(pool->nthreads < threads && !pthread_create(&thread, &attr, _raw_pool_work, pool))
+		pool->nthreads++;
+
+	bool started = pool->nthreads == threads;
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	/* couldn't start every worker */
+	if(!started) {
+		_raw_pool_free(pool);
+		return NULL;
+	}
+
+	return pool;
+} /* _raw_pool_new() */
+
+/* queues a job for every provider (the pool must be locked) */
+static void _raw_pool_queue(struct _raw_comp *comp, struct _raw_req *req) {
+	struct _raw_pool *pool = comp->pool;
+	int i;
+
+	for(i = 0; i < comp->nproviders; i++) {
+		struct _raw_job *job = _raw_malloc(sizeof(struct _raw_job));
+		job->req = req;
+		job->provider = comp->providers[i];
+		job->next = NULL;
+
+		if(pool->tail)
+			pool->tail->next = job;
+		else
+			pool->head = job;
+		pool->tail = job;
+	}
+
+	pthread_cond_broadcast(&pool->work);
+} /* _raw_pool_queue() */
+
+/* returns the common prefix of every candidate from the providers starting with str, merged with the common prefix
+ * of the candidates so far (and sets *complen to its length), or NULL if there aren't any (or none arrived in time) */
+static char *_raw_comp_provide(struct raw_t *raw, char *str, int len, char *prefix, int *complen) {
+	struct _raw_comp *comp = raw->comp;
+	struct _raw_pool *pool = comp->pool;
+	struct _raw_req *req = _raw_req_new(str, len, prefix, *complen, comp->nproviders);
+	int i;
+
+	/* without a pool, each provider is called in turn */
+	if(!pool) {
+		for(i = 0; i < comp->nproviders && !_raw_req_ready(req); i++) {
+			int n = 0;
+			char *p = _raw_provider_get(&comp->providers[i], str, len, &n);
+			_raw_req_merge(req, p, n);
 		}
+
+		prefix = req->prefix;
+		*complen = req->complen;
+
+		req->prefix = NULL;
+		_raw_req_free(req);
+		return prefix;
 	}
 
-	/* null terminate search table */
-	search = _raw_realloc(search, ++searchlen * sizeof(char *));
-	search[searchlen - 1] = NULL;
+	_raw_deadline(&req->deadline, pool->deadline);
 
-	/* call cleanup function (if defined) */
-	if(raw->comp->cleanup)
-		raw->comp->cleanup(table);
+	pthread_mutex_lock(&pool->lock);
+	_raw_pool_queue(comp, req);
 
-	return search;
-} /* _raw_comp_filter() */
+	/* wait until every provider has finished, the deadline has passed, or nothing can extend the input anymore */
+	while(!_raw_req_ready(req)) {
+		if(!pool->deadline)
+			pthread_cond_wait(&pool->done, &pool->lock);
+		else if(pthread_cond_timedwait(&pool->done, &pool->lock, &req->deadline) == ETIMEDOUT)
+			break;
+	}
 
-static char *_raw_comp_get(struct raw_t *raw, char *str) {
-	assert(raw->safe, "raw_t structure not allocated");
-	assert(raw->settings->completion, "raw_t completion not enabled");
+	prefix = req->prefix;
+	*complen = req->complen;
 
-	char **search = _raw_comp_filter(raw, str);
+	req->prefix = NULL;
+	_raw_req_drop(pool, req);
 
-	/* no matches */
-	if(!search || !search[0]) {
-		if(search) {
-			int i;
-			for(i = 0; search[i] != NULL; i++)
-				free(search[i]);
-			free(search);
+	pthread_mutex_unlock(&pool->lock);
+	return prefix;
+} /* _raw_comp_provide() */
+
+/* With asynchronous completion, a tab press only queues the request and returns, so keys keep being handled while
+ * the providers run. The input thread waits for the terminal and the wake pipe together, and once the request is
+ * ready (or its deadline has passed) the completion is applied, unless the line has changed since the tab press. */
+
+static void _raw_comp_cancel(struct raw_t *raw) {
+	struct _raw_comp *comp = raw->comp;
+
+	if(!comp->async)
+		return;
+
+	pthread_mutex_lock(&comp->pool->lock);
+	_raw_req_drop(comp->pool, comp->async);
+	pthread_mutex_unlock(&comp->pool->lock);
+
+	comp->async = NULL;
+} /* _raw_comp_cancel() */
+
+static void _raw_comp_send(struct raw_t *raw, char *str, int len, char *prefix, int complen) {
+	struct _raw_comp *comp = raw->comp;
+
+	/* only the latest tab press is completed */
+	_raw_comp_cancel(raw);
+
+	comp->async = _raw_req_new(str, len, prefix, complen, comp->nproviders);
+	comp->async->async = true;
+	_raw_deadline(&comp->async->deadline, comp->pool->deadline);
+
+	pthread_mutex_lock(&comp->pool->lock);
+	_raw_pool_queue(comp, comp->async);
+	pthread_mutex_unlock(&comp->pool->lock);
+} /* _raw_comp_send() */
+
+/* waits for the terminal to have input (returns 0) or the asynchronous request to be ready (returns 1), or returns -1
+ * if the wait was interrupted */
+static int _raw_comp_wait(struct raw_t *raw) {
+	struct _raw_pool *pool = raw->comp->pool;
+	struct pollfd fds[2];
+	int timeout = -1;
+
+	/* wake up when the deadline passes */
+	if(pool->deadline) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+
+		long sec = raw->comp->async->deadline.tv_sec - now.tv_sec, nsec = raw->comp->async->deadline.tv_nsec - now.tv_nsec;
+
+		if(nsec < 0) {
+			sec--;
+			nsec += 1000000000L;
 		}
 
-		return _raw_strdup(str);
+		/* round up, so that the wait doesn't end (and get started again) just before the deadline */
+		timeout = sec < 0 ? 0 : sec * 1000 + (nsec + 999999) / 1000000;
 	}
 
-	/* output comparison */
-	char *comp = NULL;
-	bool same = true;
-	int complen = 0, j = 0;
+	fds[0].fd = raw->term->fd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
 
+	fds[1].fd = pool->wake[0];
+	fds[1].events = POLLIN;
+	fds[1].revents = 0;
 
-	/* Get the largest common "prefix" for the entire search table. This
-	 * is to mimic the bash-like completion, where the longest common prefix
-	 * is matched, and the rest is left to the user. */
+	int ret = poll(fds, 2, timeout);
 
-	do {
-		char ch = search[0][j];
+	if(ret < 0)
+		return -1;
 
-		/* add current char to */
-		comp = _raw_realloc(comp, complen + 1);
-		comp[complen] = ch;
-		complen++;
+	if(ret && !(fds[1].revents & POLLIN))
+		return 0;
 
-		/* Check if the character in that position is the same in every item in
-		 * the search table. If so, we can use it in the chosen input. */
-		int i;
-		for(i = 1; search[i] != NULL && same; i++)
-			if(ch != search[i][j])
-				same = false;
+	/* empty the wake pipe */
+	char buf[64];
+	while(read(pool->wake[0], buf, sizeof(buf)) > 0)
+		;
 
-		/* quit if we hit the null terminator */
-		if(ch == '\0')
+	return 1;
+} /* _raw_comp_wait() */
+
+/* every candidate starts with the line, so only the rest of the prefix is added */
+static int _raw_comp_apply(struct raw_t *raw, char *prefix, int len, int complen) {
+	if(!prefix || complen == len)
+		return BELL;
+
+	raw->line->cursor = len;
+	return _raw_add_str(raw, prefix + len, complen - len);
+} /* _raw_comp_apply() */
+
+static int _raw_comp_arrive(struct raw_t *raw) {
+	struct _raw_comp *comp = raw->comp;
+	struct _raw_req *req = comp->async;
+	int err = SILENT;
+
+	/* there might not be a request anymore (the wake pipe isn't emptied when a request is dropped) */
+	if(!req)
+		return SILENT;
+
+	pthread_mutex_lock(&comp->pool->lock);
+
+	/* the wake up was for an older request, so keep waiting (unless the deadline has passed) */
+	if(!_raw_req_ready(req) && !_raw_req_expired(comp->pool, req)) {
+		pthread_mutex_unlock(&comp->pool->lock);
+		return SILENT;
+	}
+
+	/* throw the candidates away if the line has changed since the tab press */
+	if(!strcmp(req->input, _raw_gap_str(raw->line->line)))
+		err = _raw_comp_apply(raw, req->prefix, req->len, req->complen);
+
+	comp->async = NULL;
+	_raw_req_drop(comp->pool, req);
+
+	pthread_mutex_unlock(&comp->pool->lock);
+	return err;
+} /* _raw_comp_arrive() */
+
+/* == Key Bindings == */
+
+/* Every key is handled by the callback bound to it in raw->keys->bind, including the default editing keys (which
+ * are bound to the callbacks below). Applications can rebind any key, and add their own escape sequences. */
+
+static int _raw_key_self(struct raw_t *raw, int key) {
+	return _raw_insert(raw, key);
+} /* _raw_key_self() */
+
+static int _raw_key_interrupt(struct raw_t *raw, int key) {
+	(void) raw;
+	(void) key;
+	return ABORT;
+} /* _raw_key_interrupt() */
+
+static int _raw_key_eof(struct raw_t *raw, int key) {
+	(void) key;
+
+	if(raw->atexit) {
+		/* copy over abrupt input and act as enter */
+		_raw_set_line(raw, raw->atexit, 0);
+		return ENTER;
+	}
+
+	/* act as combined delete and enter */
+	if(_raw_del_char(raw) != SUCCESS)
+		/* cursor is at end, act like an enter */
+		return ENTER;
+
+	return SUCCESS;
+} /* _raw_key_eof() */
+
+static int _raw_key_complete(struct raw_t *raw, int key) {
+	(void) key;
+
+	if(!raw->settings->completion)
+		return BELL;
+
+	char *line = _raw_gap_str(raw->line->line), *prefix = NULL, *provided = NULL, *comp = NULL;
+	int err, len = raw->line->line->len, complen = 0;
+
+	/* The completion is the common prefix of the candidates from the corpus, the stream, the callback and the
+	 * providers. Once the prefix is as short as the line, the rest of the candidates can't change it. */
+	if(raw->comp->corpus)
+		prefix = _raw_corpus_get(raw->comp, line, len, &complen);
+
+	if(raw->comp->stream && !(prefix && complen == len)) {
+		raw->comp->emitting = true;
+		raw->comp->emitinput = line;
+		raw->comp->emitinputlen = len;
+		raw->comp->emitprefix = prefix;
+		raw->comp->emitlen = complen;
+
+		raw->comp->stream(raw, line);
+
+		raw->comp->emitting = false;
+		prefix = raw->comp->emitprefix;
+		complen = raw->comp->emitlen;
+	}
+
+	if(raw->comp->callback && !(prefix && complen == len) && (comp = _raw_comp_get(raw, line))) {
+		if(!prefix) {
+			prefix = comp;
+			complen = strlen(comp);
+		}
+		else {
+			complen = _raw_comp_common(prefix, comp, len, complen);
+		}
+	}
+
+	if(raw->comp->providers && !(prefix && complen == len)) {
+		/* the completion is applied by _raw_comp_arrive() once the providers are done */
+		if(raw->settings->compasync) {
+			_raw_comp_send(raw, line, len, prefix, complen);
+			free(comp);
+			return SILENT;
+		}
+
+		prefix = provided = _raw_comp_provide(raw, line, len, prefix, &complen);
+	}
+
+	err = _raw_comp_apply(raw, prefix, len, complen);
+
+	free(provided);
+	free(comp);
+	return err;
+} /* _raw_key_complete() */
+
+static int _raw_key_enter(struct raw_t *raw, int key) {
+	(void) raw;
+	(void) key;
+	return ENTER;
+} /* _raw_key_enter() */
+
+static int _raw_key_backspace(struct raw_t *raw, int key) {
+	(void) key;
+	return _raw_backspace(raw);
+} /* _raw_key_backspace() */
+
+static int _raw_key_delete(struct raw_t *raw, int key) {
+	(void) key;
+	return _raw_delete(raw);
+} /* _raw_key_delete() */
+
+static int _raw_key_move(struct raw_t *raw, int key) {
+	switch(key) {
+		case RAW_KEY_LEFT:
+			return _raw_left(raw);
+		case RAW_KEY_RIGHT:
+			/* at the end of the line, right and end accept the suggestion (if there is one) */
+			if(raw->line->cursor == raw->line->line->len)
+				return _raw_suggest_accept(raw);
+			return _raw_right(raw);
+		case RAW_KEY_HOME:
+			raw->line->cursor = 0;
 			break;
+		case RAW_KEY_END:
+			if(raw->line->cursor == raw->line->line->len)
+				return _raw_suggest_accept(raw);
+			raw->line->cursor = raw->line->line->len;
+			break;
+	}
 
-		j++;
-	} while(same);
+	return SUCCESS;
+} /* _raw_key_move() */
+
+static int _raw_key_word(struct raw_t *raw, int key) {
+	struct _raw_gap *gap = raw->line->line;
+	int dir = key == RAW_KEY_CTRL_LEFT ? -1 : 1, cur = raw->line->cursor;
+
+	/* skip over any spaces, and then over the word */
+	if(dir < 0) {
+		while(cur > 0 && _raw_gap_at(gap, cur - 1) == ' ')
+			cur--;
+		while(cur > 0 && _raw_gap_at(gap, cur - 1) != ' ')
+			cur--;
+	}
+	else {
+		while(cur < gap->len && _raw_gap_at(gap, cur) == ' ')
+			cur++;
+		while(cur < gap->len && _raw_gap_at(gap, cur) != ' ')
+			cur++;
+	}
 
-	/* null terminate */
-	comp[complen - 1] = '\0';
+	if(cur == raw->line->cursor)
+		return SILENT;
+
+	raw->line->cursor = cur;
+	return SUCCESS;
+} /* _raw_key_word() */
+
+static int _raw_key_history(struct raw_t *raw, int key) {
+	if(!raw->settings->history)
+		return BELL;
+
+	int err = _raw_hist_move(raw, key == RAW_KEY_UP ? _RAW_HIST_PREV : _RAW_HIST_NEXT);
+	raw->line->cursor = raw->line->line->len;
+
+	return err;
+} /* _raw_key_history() */
+
+static void _raw_search_prompt(struct _raw_buf *prompt, struct _raw_buf *query, bool failed) {
+	prompt->len = 0;
+
+	if(failed)
+		_raw_buf_add(prompt, "(failed ", 8);
+	else
+		_raw_buf_add(prompt, "(", 1);
+
+	_raw_buf_add(prompt, "reverse-i-search)`", 18);
+	_raw_buf_add(prompt, query->buf, query->len);
+	_raw_buf_add(prompt, "': ", 4); /* including the NUL */
+} /* _raw_search_prompt() */
+
+static int _raw_search_find(struct raw_t *raw, char *str, int from, int nth) {
+	/* with frecency kept, items are found in the order they rank in (nth is how far down), otherwise from the latest
+	 * item to the oldest (from from onwards) */
+	if(raw->settings->frecency)
+		return _raw_hist_ranked(raw->hist, str, nth);
+
+	return _raw_hist_search(raw->hist, str, from, NULL);
+} /* _raw_search_find() */
+
+static int _raw_key_search(struct raw_t *raw, int key) {
+	if(!raw->settings->history)
+		return BELL;
+
+	/* Incremental reverse search has its own loop, which reads keys until the search is finished. The search string
+	 * is shown in the prompt, and the line is the latest history item containing it. Pressing the search key again
+	 * finds the next older item, ctrl-g or escape cancels the search, and any other key accepts the item and is then
+	 * handled as usual. */
+
+	struct _raw_hist *hist = raw->hist;
+	struct _raw_buf *query = _raw_buf_new(32), *prompt = _raw_buf_new(64);
+	char *oldprompt = raw->line->prompt->str, *line = _raw_strdup(_raw_gap_str(raw->line->line));
+	int cursor = raw->line->cursor, changed = raw->line->changed, match = -1, rank = -1, next = RAW_KEY_NONE;
+	bool failed = false, suggesting = raw->line->suggesting;
+
+	/* the line is a history item while searching, so nothing is suggested after it (or completed by an outstanding
+	 * asynchronous completion) */
+	raw->line->suggesting = false;
+
+	if(raw->comp)
+		_raw_comp_cancel(raw);
+
+	/* keep the line, so it can be gone back to as if the history had been browsed */
+	_raw_hist_keep(raw);
+
+	/* the query is searched for as a string, even before anything is typed */
+	_raw_buf_add(query, "", 1);
+	query->len--;
+
+	_raw_search_prompt(prompt, query, failed);
+	_raw_set_prompt(raw, prompt->buf);
+	_raw_redraw(raw);
+	_raw_out_flush(raw);
 
-	/* clean up search table */
+	while(next == RAW_KEY_NONE) {
+		int err = SUCCESS, found = -2, want = 0, in = _raw_key_get(raw);
+
+		if(in == RAW_KEY_NONE) {
+			if(raw->term->winch != _raw_winch) {
+				_raw_redraw(raw);
+				_raw_out_flush(raw);
+			}
+			continue;
+		}
+
+		if(in == key) {
+			/* find the next older (or next best) item */
+			want = rank + 1;
+			found = _raw_search_find(raw, query->buf, match + 1, want);
+		}
+		else if(in == RAW_KEY_PASTE || (in >= 32 && in < 127)) {
+			if(in == RAW_KEY_PASTE) {
+				_raw_buf_add(query, raw->keys->paste->buf, raw->keys->paste->len);
+				raw->keys->paste->len = 0;
+			}
+			else {
+				char ch = in;
+				_raw_buf_add(query, &ch, 1);
+			}
+
+			/* a longer string can only narrow the search, so the current item is checked first */
+			_raw_buf_add(query, "", 1);
+			query->len--;
+			found = _raw_search_find(raw, query->buf, match, 0);
+		}
+		else if(in == 8 || in == 127) {
+			if(!query->len) {
+				err = BELL;
+			}
+			else {
+				query->buf[--query->len] = '\0';
+				found = _raw_search_find(raw, query->buf, 0, 0);
+			}
+		}
+		else if(in == 7 || in == RAW_KEY_ESC) {
+			/* cancel the search, going back to the line from before it started */
+			_raw_set_line(raw, line, cursor);
+			raw->line->changed = changed;
+			next = -2;
+		}
+		else {
+			/* accept the item, and handle the key */
+			if(match >= 0) {
+				hist->index = match;
+				raw->line->changed = false;
+			}
+			next = in;
+		}
+
+		if(found >= 0) {
+			char *item = _raw_hist_get(hist, found);
+
+			match = found;
+			rank = want;
+			failed = false;
+			_raw_set_line(raw, item, strstr(item, query->buf) - item);
+		}
+		else if(found == -1) {
+			failed = true;
+			err = BELL;
+		}
+
+		if(err != SUCCESS)
+			_raw_error(raw, err);
+
+		if(next == RAW_KEY_NONE && !_raw_key_pending(raw)) {
+			_raw_search_prompt(prompt, query, failed);
+			_raw_set_prompt(raw, prompt->buf);
+			_raw_redraw(raw);
+			_raw_out_flush(raw);
+		}
+	}
+
+	/* go back to the original prompt */
+	raw->line->suggesting = suggesting;
+	_raw_set_prompt(raw, oldprompt);
+
+	_raw_buf_free(query);
+	_raw_buf_free(prompt);
+	free(line);
+
+	if(next < 0)
+		return SUCCESS;
+
+	/* internal keys (which can't be bound) are never handed back by the search */
+	return next < RAW_KEY_MAX && raw->keys->bind[next] ? raw->keys->bind[next](raw, next) : BELL;
+} /* _raw_key_search() */
+
+static struct _raw_keys *_raw_keys_new(void) {
+	struct _raw_keys *keys = _raw_malloc(sizeof(struct _raw_keys));
 	int i;
-	for(i = 0; search[i] != NULL; i++)
-		free(search[i]);
-	free(search);
 
-	/* give prefix */
-	return comp;
-} /* _raw_comp_get() */
+	/* default bindings (anything not bound rings the bell) */
+	for(i = 0; i < RAW_KEY_MAX; i++)
+		keys->bind[i] = NULL;
+
+	for(i = 32; i < 127; i++)
+		keys->bind[i] = _raw_key_self;
+
+	keys->bind[3] = _raw_key_interrupt; /* ctrl-c */
+	keys->bind[4] = _raw_key_eof; /* ctrl-d */
+	keys->bind[8] = _raw_key_backspace; /* backspace */
+	keys->bind[9] = _raw_key_complete; /* tab */
+	keys->bind[13] = _raw_key_enter; /* enter */
+	keys->bind[18] = _raw_key_search; /* ctrl-r */
+	keys->bind[127] = _raw_key_backspace; /* ctrl-h (sometimes used as backspace) */
+
+	keys->bind[RAW_KEY_UP] = _raw_key_history;
+	keys->bind[RAW_KEY_DOWN] = _raw_key_history;
+	keys->bind[RAW_KEY_LEFT] = _raw_key_move;
+	keys->bind[RAW_KEY_RIGHT] = _raw_key_move;
+	keys->bind[RAW_KEY_HOME] = _raw_key_move;
+	keys->bind[RAW_KEY_END] = _raw_key_move;
+	keys->bind[RAW_KEY_DELETE] = _raw_key_delete;
+	keys->bind[RAW_KEY_CTRL_LEFT] = _raw_key_word;
+	keys->bind[RAW_KEY_CTRL_RIGHT] = _raw_key_word;
+
+	/* build the escape sequence trie, starting with just the root */
+	keys->triesize = 64;
+	keys->trie = _raw_malloc(keys->triesize * sizeof(struct _raw_trie));
+
+	keys->trielen = 1;
+	keys->trie[0].ch = 27;
+	keys->trie[0].key = RAW_KEY_NONE;
+	keys->trie[0].child = 0;
+	keys->trie[0].next = 0;
+
+	for(i = 0; _raw_seqs[i].seq != NULL; i++)
+		_raw_trie_add(keys, _raw_seqs[i].seq, _raw_seqs[i].key);
+
+	/* decoder state */
+	keys->timeout = _RAW_ESC_TIMEOUT;
+	keys->state = DEC_NONE;
+	keys->node = 0;
+	keys->csi = false;
+	keys->paste = _raw_buf_new(256);
+	keys->pastematch = 0;
+
+	return keys;
+} /* _raw_keys_new() */
+
+static void _raw_keys_free(struct _raw_keys *keys) {
+	free(keys->trie);
+	_raw_buf_free(keys->paste);
+	free(keys);
+} /* _raw_keys_free() */
 
 /* Functions exposed as an API, for external use. These functions are the only functions which outside
  * programs will ever need to use. They handle *ALL* memory management, and rawline structures aren't
@@ -576,27 +4348,50 @@ struct raw_t *raw_new(char *atexit) {
 	/* set up blank input line */
 	raw->line = _raw_malloc(sizeof(struct _raw_line));
 	raw->line->prompt = _raw_malloc(sizeof(struct _raw_str));
-	raw->line->line = _raw_malloc(sizeof(struct _raw_str));
+	raw->line->line = _raw_gap_new();
 
 	/* set the line to "" */
-	raw->line->line->str = _raw_strdup("");
-	raw->line->line->len = 0;
 	raw->line->oldcursor = 0;
+	raw->line->oldlen = 0;
+	raw->line->dirty = -1;
+	raw->line->changed = false;
+	raw->line->pwidth = 0;
 	raw->line->cursor = 0;
+	raw->line->suggesting = false;
+	raw->line->suggest = -1;
+	raw->line->suggestfrom = 0;
+	raw->line->suggestcol = 0;
 
 	/* set up standard settings */
 	raw->settings = _raw_malloc(sizeof(struct _raw_set));
 	raw->settings->history = false;
 	raw->settings->completion = false;
+	raw->settings->erasedups = false;
+	raw->settings->prefix = false;
+	raw->settings->suggest = false;
+	raw->settings->frecency = false;
+	raw->settings->compcache = false;
+	raw->settings->comppool = false;
+	raw->settings->compasync = false;
 
 	/* set up terminal settings */
 	raw->term = _raw_malloc(sizeof(struct _raw_term));
 	raw->term->fd = STDIN_FILENO;
+	raw->term->ofd = STDOUT_FILENO;
+	raw->term->out = _raw_buf_new(256);
+	raw->term->in = _raw_buf_new(_RAW_IN_SIZE);
+	raw->term->inpos = 0;
+	raw->term->cols = 80;
+	raw->term->winch = 0;
 	raw->term->mode = false;
 	tcgetattr(0, &raw->term->original);
 
+	/* set up the key decoder and default key bindings */
+	raw->keys = _raw_keys_new();
+
 	/* history is off by default */
 	raw->hist = NULL;
+	raw->journal = NULL;
 
 	/* completion is off by default */
 	raw->comp = NULL;
@@ -631,6 +4426,16 @@ int raw_hist(struct raw_t *raw, bool set, int size) {
 	else {
 		_raw_hist_free(raw->hist);
 		free(raw->hist);
+		raw->settings->erasedups = false;
+		raw->settings->prefix = false;
+		raw->settings->suggest = false;
+		raw->settings->frecency = false;
+
+		/* the journal goes with the history */
+		if(raw->journal) {
+			_raw_journal_free(raw->journal);
+			raw->journal = NULL;
+		}
 	}
 
 	return 0;
@@ -640,7 +4445,12 @@ void raw_hist_add_str(struct raw_t *raw, char *str) {
 	assert(raw->safe, "raw_t structure not allocated");
 	assert(raw->settings->history, "raw_t history is not enabled");
 
+	int count = raw->hist->count;
 	_raw_hist_add_str(raw, str);
+
+	/* only items which were actually added (not duplicates) go in the journal */
+	if(raw->journal && raw->hist->count != count)
+		_raw_journal_add(raw, str);
 } /* raw_hist_add_str() */
 
 void raw_hist_add(struct raw_t *raw) {
@@ -648,7 +4458,7 @@ void raw_hist_add(struct raw_t *raw) {
 	assert(raw->settings->history, "raw_t history is not enabled");
 	assert(raw->buffer, "no previous input stored in raw_t structure");
 
-	_raw_hist_add_str(raw, raw->buffer);
+	raw_hist_add_str(raw, raw->buffer);
 } /* raw_hist_add() */
 
 char *raw_hist_get(struct raw_t *raw) {
@@ -671,6 +4481,163 @@ int raw_hist_set(struct raw_t *raw, char *str) {
 	return _raw_hist_from_serial(raw, str);
 } /* raw_hist_set() */
 
+int raw_hist_erasedups(struct raw_t *raw, bool set) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->history, "raw_t history is not enabled");
+
+	/* ignore re-setting of erasing duplicates */
+	if(raw->settings->erasedups == BOOL(set))
+		return -2;
+
+	raw->settings->erasedups = BOOL(set);
+
+	/* the index of items is built when the next item is added (it is still needed for frecency) */
+	if(!set && !raw->hist->frecency) {
+		free(raw->hist->dups);
+		raw->hist->dups = NULL;
+	}
+
+	return 0;
+} /* raw_hist_erasedups() */
+
+int raw_hist_prefix(struct raw_t *raw, bool set) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->history, "raw_t history is not enabled");
+
+	/* ignore re-setting of prefix browsing */
+	if(raw->settings->prefix == BOOL(set))
+		return -2;
+
+	raw->settings->prefix = BOOL(set);
+
+	/* the index of items is built when browsing next starts (it is still needed for suggestions) */
+	if(!set && !raw->settings->suggest)
+		_raw_sorted_free(raw->hist);
+
+	return 0;
+} /* raw_hist_prefix() */
+
+int raw_hist_suggest(struct raw_t *raw, bool set) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->history, "raw_t history is not enabled");
+
+	/* ignore re-setting of suggestions */
+	if(raw->settings->suggest == BOOL(set))
+		return -2;
+
+	raw->settings->suggest = BOOL(set);
+
+	/* the index of items is built when the first suggestion is needed (it is still needed for prefix browsing) */
+	if(!set && !raw->settings->prefix)
+		_raw_sorted_free(raw->hist);
+
+	return 0;
+} /* raw_hist_suggest() */
+
+int raw_hist_frecency(struct raw_t *raw, bool set) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->history, "raw_t history is not enabled");
+
+	/* ignore re-setting of frecency */
+	if(raw->settings->frecency == BOOL(set))
+		return -2;
+
+	raw->settings->frecency = BOOL(set);
+
+	/* items already in the history count as having been used once, a long time ago */
+	if(set) {
+		raw->hist->frecency = _raw_calloc(raw->hist->max, sizeof(struct _raw_frecency));
+	}
+	else {
+		free(raw->hist->frecency);
+		raw->hist->frecency = NULL;
+
+		if(!raw->settings->erasedups) {
+			free(raw->hist->dups);
+			raw->hist->dups = NULL;
+		}
+	}
+
+	/* the suggestion might not be the best item anymore */
+	_raw_suggest_reset(raw->hist);
+	return 0;
+} /* raw_hist_frecency() */
+
+int raw_hist_save(struct raw_t *raw, int fd) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->history, "raw_t history is not enabled");
+
+	return _raw_hist_save(raw, fd, NULL, raw->settings->frecency);
+} /* raw_hist_save() */
+
+int raw_hist_fsave(struct raw_t *raw, FILE *file) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->history, "raw_t history is not enabled");
+	assert(file, "no file given");
+
+	return _raw_hist_save(raw, -1, file, raw->settings->frecency);
+} /* raw_hist_fsave() */
+
+int raw_hist_load(struct raw_t *raw, int fd) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->history, "raw_t history is not enabled");
+
+	return _raw_hist_load(raw, fd, NULL);
+} /* raw_hist_load() */
+
+int raw_hist_fload(struct raw_t *raw, FILE *file) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->history, "raw_t history is not enabled");
+	assert(file, "no file given");
+
+	return _raw_hist_load(raw, -1, file);
+} /* raw_hist_fload() */
+
+int raw_hist_save_index(struct raw_t *raw, int fd) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->history, "raw_t history is not enabled");
+
+	return _raw_hist_save_index(raw, fd);
+} /* raw_hist_save_index() */
+
+int raw_hist_map(struct raw_t *raw, int fd) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->history, "raw_t history is not enabled");
+
+	return _raw_hist_map(raw, fd);
+} /* raw_hist_map() */
+
+int raw_hist_journal(struct raw_t *raw, char *path, int sync) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->history, "raw_t history is not enabled");
+
+	/* sync can't be negative */
+	if(sync < 0)
+		return -1;
+
+	/* close the old journal */
+	if(raw->journal) {
+		_raw_journal_free(raw->journal);
+		raw->journal = NULL;
+	}
+
+	if(!path)
+		return 0;
+
+	return _raw_journal_open(raw, path, sync);
+} /* raw_hist_journal() */
+
+int raw_hist_journal_compact(struct raw_t *raw) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->history, "raw_t history is not enabled");
+
+	/* no journal to compact */
+	if(!raw->journal)
+		return -1;
+
+	return _raw_journal_compact(raw);
+} /* raw_hist_journal_compact() */
+
 int raw_comp(struct raw_t *raw, bool set, char **(*callback)(char *), void (*cleanup)(char **)) {
 	assert(raw->safe, "raw_t structure not allocated");
 
@@ -679,29 +4646,280 @@ int raw_comp(struct raw_t *raw, bool set, char **(*callback)(char *), void (*cle
 		return -1;
 
 	/* ignore re-setting of completion */
-	if(raw->settings->completion == BOOL(set))
+	if(BOOL(raw->comp && raw->comp->callback) == BOOL(set))
 		return -2;
 
-	raw->settings->completion = BOOL(set);
-
 	if(set) {
-		raw->comp = _raw_malloc(sizeof(struct _raw_comp));
+		if(!raw->comp)
+			raw->comp = _raw_comp_new();
+
 		raw->comp->callback = callback;
 		raw->comp->cleanup = cleanup;
 	}
 	else {
-		free(raw->comp);
+		_raw_comp_forget(raw->comp);
+		raw->comp->callback = NULL;
+		raw->comp->cleanup = NULL;
+		raw->comp->ttl = 0;
+		raw->settings->compcache = false;
 	}
 
+	_raw_comp_update(raw);
 	return 0;
 } /* raw_comp() */
 
+int raw_comp_corpus(struct raw_t *raw, bool set, char **corpus) {
+	assert(raw->safe, "raw_t structure not allocated");
+
+	/* a corpus is required */
+	if(set && !corpus)
+		return -1;
+
+	/* ignore re-setting of the corpus */
+	if(BOOL(raw->comp && raw->comp->corpus) == BOOL(set))
+		return -2;
+
+	if(set) {
+		if(!raw->comp)
+			raw->comp = _raw_comp_new();
+
+		_raw_corpus_build(raw->comp, corpus);
+	}
+	else {
+		_raw_corpus_free(raw->comp);
+	}
+
+	_raw_comp_update(raw);
+	return 0;
+} /* raw_comp_corpus() */
+
+int raw_comp_stream(struct raw_t *raw, bool set, void (*stream)(struct raw_t *, char *)) {
+	assert(raw->safe, "raw_t structure not allocated");
+
+	/* stream() is required */
+	if(!stream)
+		return -1;
+
+	/* ignore re-setting of the stream */
+	if(BOOL(raw->comp && raw->comp->stream) == BOOL(set))
+		return -2;
+
+	if(set) {
+		if(!raw->comp)
+			raw->comp = _raw_comp_new();
+
+		raw->comp->stream = stream;
+	}
+	else {
+		raw->comp->stream = NULL;
+	}
+
+	_raw_comp_update(raw);
+	return 0;
+} /* raw_comp_stream() */
+
+int raw_comp_provider(struct raw_t *raw, bool set, char **(*callback)(char *), void (*cleanup)(char **)) {
+	assert(raw->safe, "raw_t structure not allocated");
+
+	/* callback() is required */
+	if(!callback)
+		return -1;
+
+	struct _raw_comp *comp = raw->comp;
+	int i;
+
+	/* find the provider */
+	for(i = 0; comp && i < comp->nproviders; i++)
+		if(comp->providers[i].callback == callback)
+			break;
+
+	/* ignore re-setting of the provider */
+	if(BOOL(comp && i < comp->nproviders) == BOOL(set))
+		return -2;
+
+	if(set) {
+		if(!raw->comp)
+			comp = raw->comp = _raw_comp_new();
+
+		comp->providers = _raw_realloc(comp->providers, (comp->nproviders + 1) * sizeof(struct _raw_provider));
+		comp->providers[comp->nproviders].callback = callback;
+		comp->providers[comp->nproviders].cleanup = cleanup;
+		comp->nproviders++;
+	}
+	else {
+		/* jobs which are still running have their own copy of the provider */
+		memmove(comp->providers + i, comp->providers + i + 1, (comp->nproviders - i - 1) * sizeof(struct _raw_provider));
+
+		if(!--comp->nproviders) {
+			free(comp->providers);
+			comp->providers = NULL;
+		}
+	}
+
+	_raw_comp_update(raw);
+	return 0;
+} /* raw_comp_provider() */
+
+int raw_comp_pool(struct raw_t *raw, bool set, int threads, int deadline) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->completion, "raw_t completion is not enabled");
+
+	/* there must be a worker, and the deadline can't be negative */
+	if(set && (threads < 1 || deadline < 0))
+		return -1;
+
+	/* ignore re-setting of the pool */
+	if(raw->settings->comppool == BOOL(set))
+		return -2;
+
+	if(set) {
+		raw->comp->pool = _raw_pool_new(threads, deadline);
+
+		/* the workers couldn't be started */
+		if(!raw->comp->pool)
+			return -1;
+	}
+	else {
+		_raw_comp_cancel(raw);
+		_raw_pool_free(raw->comp->pool);
+		raw->comp->pool = NULL;
+		raw->settings->compasync = false;
+	}
+
+	raw->settings->comppool = BOOL(set);
+	return 0;
+} /* raw_comp_pool() */
+
+int raw_comp_async(struct raw_t *raw, bool set) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->comppool, "raw_t completion pool is not enabled");
+
+	/* ignore re-setting of asynchronous completion */
+	if(raw->settings->compasync == BOOL(set))
+		return -2;
+
+	raw->settings->compasync = BOOL(set);
+
+	if(!set)
+		_raw_comp_cancel(raw);
+
+	return 0;
+} /* raw_comp_async() */
+
+int raw_comp_emit(struct raw_t *raw, char *candidate) {
+	assert(raw->safe, "raw_t structure not allocated");
+
+	struct _raw_comp *comp = raw->comp;
+
+	/* candidates can only be emitted by stream() */
+	if(!comp || !comp->emitting || !candidate)
+		return -1;
+
+	/* valid candidates must start with the input */
+	if(!strncmp(candidate, comp->emitinput, comp->emitinputlen))
+		_raw_comp_emit(comp, candidate);
+
+	/* once the common prefix is just the input, the rest of the candidates can't change it */
+	return comp->emitprefix && comp->emitlen == comp->emitinputlen;
+} /* raw_comp_emit() */
+
+int raw_comp_cache(struct raw_t *raw, bool set, int ttl) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->completion, "raw_t completion is not enabled");
+
+	/* the time to live can't be negative */
+	if(set && ttl < 0)
+		return -1;
+
+	/* ignore re-setting of caching */
+	if(raw->settings->compcache == BOOL(set))
+		return -2;
+
+	raw->settings->compcache = BOOL(set);
+	raw->comp->ttl = ttl;
+
+	if(!set)
+		_raw_comp_forget(raw->comp);
+
+	return 0;
+} /* raw_comp_cache() */
+
+void raw_comp_cache_clear(struct raw_t *raw) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(raw->settings->completion, "raw_t completion is not enabled");
+
+	_raw_comp_forget(raw->comp);
+} /* raw_comp_cache_clear() */
+
+int raw_bind(struct raw_t *raw, int key, int (*callback)(struct raw_t *, int)) {
+	assert(raw->safe, "raw_t structure not allocated");
+
+	/* key must be a byte or a key given by the decoder */
+	if(key < 0 || key >= RAW_KEY_MAX)
+		return -1;
+
+	/* a NULL callback unbinds the key */
+	raw->keys->bind[key] = callback;
+	return 0;
+} /* raw_bind() */
+
+int raw_bind_seq(struct raw_t *raw, char *seq, int key) {
+	assert(raw->safe, "raw_t structure not allocated");
+
+	/* only escape sequences (with something after the ESC) can be added */
+	if(!seq || seq[0] != 27 || !seq[1])
+		return -1;
+
+	if(key < 0 || key >= RAW_KEY_MAX)
+		return -2;
+
+	_raw_trie_add(raw->keys, seq + 1, key);
+	return 0;
+} /* raw_bind_seq() */
+
+void raw_esc_timeout(struct raw_t *raw, int timeout) {
+	assert(raw->safe, "raw_t structure not allocated");
+
+	if(timeout < 0)
+		timeout = 0;
+
+	raw->keys->timeout = timeout;
+} /* raw_esc_timeout() */
+
+char *raw_line_get(struct raw_t *raw, int *cursor) {
+	assert(raw->safe, "raw_t structure not allocated");
+
+	if(cursor)
+		*cursor = raw->line->cursor;
+
+	return _raw_gap_str(raw->line->line);
+} /* raw_line_get() */
+
+void raw_line_set(struct raw_t *raw, char *str, int cursor) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(str, "no string given");
+
+	/* str could be (part of) the string given by raw_line_get() */
+	str = _raw_strdup(str);
+	_raw_set_line(raw, str, cursor);
+	free(str);
+} /* raw_line_set() */
+
+void raw_line_insert(struct raw_t *raw, char *str) {
+	assert(raw->safe, "raw_t structure not allocated");
+	assert(str, "no string given");
+
+	/* str could be (part of) the string given by raw_line_get(), which moves when the line grows */
+	str = _raw_strdup(str);
+	_raw_add_str(raw, str, strlen(str));
+	free(str);
+} /* raw_line_insert() */
+
 void raw_free(struct raw_t *raw) {
 	assert(raw->safe, "raw_t structure not allocated");
 
 	/* completely clear out line */
-	free(raw->line->line->str);
-	free(raw->line->line);
+	_raw_gap_free(raw->line->line);
 	free(raw->line->prompt);
 	free(raw->line);
 
@@ -712,14 +4930,23 @@ void raw_free(struct raw_t *raw) {
 		free(raw->hist);
 	}
 
+	/* close the journal (which syncs any items which haven't been synced) */
+	if(raw->journal)
+		_raw_journal_free(raw->journal);
+
 	/* clear out completion */
 	if(raw->settings->completion)
-		free(raw->comp);
+		_raw_comp_free(raw);
+
+	/* clear out key bindings */
+	_raw_keys_free(raw->keys);
 
 	/* clear out settings */
 	free(raw->settings);
 
 	/* clear out terminal settings */
+	_raw_buf_free(raw->term->out);
+	_raw_buf_free(raw->term->in);
 	free(raw->term);
 
 	/* clear out everything else */
@@ -734,30 +4961,38 @@ void raw_free(struct raw_t *raw) {
 char *raw_input(struct raw_t *raw, char *prompt) {
 	assert(raw->safe, "raw_t structure not allocated");
 
-	/* erase old line information */
+	/* erase old line information (the new line hasn't been drawn yet) */
 	_raw_set_line(raw, "", 0);
+	raw->line->oldcursor = 0;
+	raw->line->oldlen = 0;
+	raw->line->dirty = -1;
+	raw->line->suggesting = raw->settings->suggest;
+	raw->line->suggest = -1;
+
 	if(raw->settings->history)
 		raw->hist->index = -1;
 
+	/* pick up any items other instances have added to the journal */
+	if(raw->journal)
+		_raw_journal_update(raw);
+
+	/* an asynchronous completion of the last line is never applied */
+	if(raw->comp)
+		_raw_comp_cancel(raw);
+
 	/* get prompt string and print it */
 	raw->line->prompt->str = prompt;
 	raw->line->prompt->len = strlen(raw->line->prompt->str);
+	raw->line->pwidth = _raw_strwidth(raw->line->prompt->str);
 
-	fputs(raw->line->prompt->str, stdout);
-	fflush(stdout);
-
-	/* make a copy of the history */
-	struct _raw_hist *hist = NULL;
-
-	if(raw->settings->history) {
-		hist = _raw_hist_new(raw->hist->max - 1);
+	/* the terminal could have been resized since the last line */
+	_raw_term_size(raw);
 
-		int i;
-		for(i = 0; i < raw->hist->len; i++)
-			hist->history[i] = _raw_strdup(raw->hist->history[i]);
+	/* anything the application printed has to reach the terminal before the prompt */
+	fflush(stdout);
 
-		hist->len = raw->hist->len;
-	}
+	_raw_out_str(raw, raw->line->prompt->str);
+	_raw_out_flush(raw);
 
 	/* set up state */
 	int enter = false;
@@ -766,188 +5001,91 @@ char *raw_input(struct raw_t *raw, char *prompt) {
 	_raw_mode(raw, true);
 
 	do {
-		raw->line->oldcursor = raw->line->cursor;
-		int err = SUCCESS, move = false;
-
-		/* get first char */
-		char ch;
-		if(read(raw->term->fd, &ch, 1) < 0)
+		int err = SUCCESS;
+
+		/* get the next key */
+		int key = _raw_key_get(raw);
+		if(key == RAW_KEY_NONE) {
+			/* redraw straight away if the read was interrupted by a resize */
+			if(raw->term->winch != _raw_winch) {
+				_raw_redraw(raw);
+				_raw_out_flush(raw);
+			}
 			continue;
+		}
 
-		/* simple printable chars */
-		if(ch > 31 && ch < 127) {
-			err = _raw_insert(raw, ch);
-		} else {
-			switch(ch) {
-				case 3: /* ctrl-c */
-					/* disable raw mode */
-					_raw_mode(raw, false);
-
-					/* free temporary history */
-					if(raw->settings->history) {
-						_raw_hist_free(hist);
-						free(hist);
-					}
-
-					/* raise the expected signal (return NULL to seal the deal [if there is a handler]) */
-					raise(SIGINT);
-					return NULL;
-				case 4: /* ctrl-d */
-					if(raw->atexit) {
-						/* copy over abrupt input and act as enter */
-						_raw_set_line(raw, raw->atexit, 0);
-						enter = true;
-					}
-
-					/* act as combined delete and enter */
-					else if(_raw_del_char(raw) != SUCCESS)
-						/* cursor is at end, act like an enter */
-						enter = true;
-					break;
-				case 9: /* tab */
-					if(raw->settings->completion) {
-						char *comp = _raw_comp_get(raw, raw->line->line->str);
-
-						if(!strcmp(comp, raw->line->line->str)) {
-							err = BELL;
-						}
-
-						else {
-							_raw_set_line(raw, comp, 0);
-							raw->line->cursor = raw->line->line->len;
-						}
+		if(key == RAW_KEY_PASTE) {
+			/* pasted text is inserted literally, even control characters */
+			err = _raw_add_str(raw, raw->keys->paste->buf, raw->keys->paste->len);
+			raw->keys->paste->len = 0;
+		}
+		else if(key == RAW_KEY_COMPLETE) {
+			/* apply the candidates from the providers (if the line hasn't changed) */
+			err = _raw_comp_arrive(raw);
+		}
+		else if(key < RAW_KEY_MAX && raw->keys->bind[key]) {
+			/* run the callback bound to the key */
+			err = raw->keys->bind[key](raw, key);
+		}
+		else {
+			err = BELL;
+		}
 
-						free(comp);
-					}
-					else {
-						err = BELL;
-					}
-					break;
-				case 13: /* enter */
-					enter = true;
-					break;
-				case 127: /* ctrl-h (sometimes used as backspace) */
-				case 8: /* backspace */
-					err = _raw_backspace(raw);
-					break;
-				case 27: /* escape (start of sequence) */
-					{
-						/* get next two chars from the sequence */
-						char seq[2];
-						if(read(raw->term->fd, seq, 2) < 0)
-							/* no extra characters */
-							break;
-
-						/* first character of escape sequence isn't standard on all keyboards,
-						 * so just ignore it and focus on the actual key */
-						switch(seq[1]) {
-							case 68:
-								/* left arrow */
-								move = true;
-								err = _raw_left(raw);
-								break;
-							case 67:
-								/* right arrow */
-								move = true;
-								err = _raw_right(raw);
-								break;
-							case 65: /* up arrow */
-							case 66: /* down arrow */
-								if(raw->settings->history) {
-									int dir = seq[1] == 65 ? _RAW_HIST_PREV : _RAW_HIST_NEXT;
-
-									err = _raw_hist_move(raw, dir);
-									raw->line->cursor = raw->line->line->len;
-								}
-								else {
-									err = BELL;
-								}
-								break;
-							case 49:
-							case 50:
-							case 51:
-							case 52:
-							case 53:
-							case 54:
-								/* extended escape */
-								{
-									/* read next two byes of extended escape sequence */
-									char eseq;
-									if(read(raw->term->fd, &eseq, 1) < 0)
-										/* no extra characters */
-										break;
-
-									if(eseq == 126) {
-										switch(seq[1]) {
-											case 51: /* delete */
-												err = _raw_delete(raw);
-												break;
-											case 49: /* home */
-												raw->line->cursor = 0;
-												move = true;
-												break;
-											case 52: /* end */
-												raw->line->cursor = raw->line->line->len;
-												move = true;
-												break;
-											default:
-												err = BELL;
-												break;
-										}
-									}
-								}
-								break;
-							case 70: /* end */
-								raw->line->cursor = raw->line->line->len;
-								move = true;
-								break;
-							case 72: /* home */
-								raw->line->cursor = 0;
-								move = true;
-								break;
-							default:
-								err = BELL;
-								break;
-						}
-					}
-					break;
-				default:
-					err = BELL;
-					break;
-			}
+		switch(err) {
+			case ABORT:
+				/* don't leave the suggestion behind on the terminal */
+				_raw_suggest_hide(raw);
+				_raw_out_flush(raw);
+
+				/* disable raw mode */
+				_raw_mode(raw, false);
+
+				/* throw away history edits */
+				if(raw->settings->history)
+					_raw_hist_reset(raw->hist);
+
+				/* raise the expected signal (return NULL to seal the deal [if there is a handler]) */
+				raise(SIGINT);
+				return NULL;
+			case ENTER:
+				enter = true;
+				err = SUCCESS;
+				break;
 		}
 
 		/* was there an error? if so, act on it and don't update anything */
-		if(err != SUCCESS) {
-			_raw_error(err);
-			continue;
+		if(err != SUCCESS)
+			_raw_error(raw, err);
+
+		/* leave the cursor after the line, so that the newline doesn't land in the middle of a wrapped line (and
+		 * clear the suggestion, since it wasn't accepted) */
+		if(enter) {
+			raw->line->cursor = raw->line->line->len;
+			_raw_suggest_hide(raw);
 		}
 
-		/* redraw input */
-		_raw_redraw(raw, !move);
-
-		/* add current line status to temporary history */
-		if(raw->hist->index >= 0)
-			_raw_hist_add_str(raw, raw->line->line->str);
-
+		/* If more keys are already waiting, apply them before drawing anything. Under key repeat (or with
+		 * replayed input) this keeps the terminal from falling behind, since only the last frame matters. */
+		if(enter || !_raw_key_pending(raw)) {
+			_raw_redraw(raw);
+			_raw_out_flush(raw);
+		}
 	} while(!enter);
 
 	/* disable raw mode */
 	_raw_mode(raw, false);
 
 	/* print the enter newline */
-	putc('\n', stdout);
+	_raw_out_str(raw, "\n");
+	_raw_out_flush(raw);
 
-	/* free "temporary" history and point raw-> to it */
-	if(raw->settings->history) {
-		_raw_hist_free(raw->hist);
-		free(raw->hist);
-		raw->hist = hist;
-	}
+	/* throw away history edits */
+	if(raw->settings->history)
+		_raw_hist_reset(raw->hist);
 
 	/* copy over input to buffer */
 	free(raw->buffer);
-	raw->buffer = _raw_strdup(raw->line->line->str);
+	raw->buffer = _raw_strdup(_raw_gap_str(raw->line->line));
 
 	/* return buffer */
 	return raw->buffer;
@@ -9,6 +9,7 @@
 #ifndef __RAWLINE_H__
 #define __RAWLINE_H__
 
+#include <stdio.h>
 #include <termios.h>
 
 /* Define bools. */
@@ -26,12 +27,45 @@ struct raw_t {
 	struct _raw_set *settings; /* settings of line editing */
 	struct _raw_term *term; /* terminal state / settings */
 	struct _raw_hist *hist; /* history data */
+	struct _raw_journal *journal; /* history journal (NULL if there isn't one) */
 	struct _raw_comp *comp; /* completion data */
+	struct _raw_keys *keys; /* key decoder and key bindings */
 
 	char *atexit; /* the line to return if input is abruptly exited (if NULL, delete current character [if possible] else return current input) */
 	char *buffer; /* "output buffer", used to hold latest line to keep all memory management in rawline */
 };
 
+/* Keys which can be bound with raw_bind(). A byte which isn't part of an escape sequence is a key
+ * of its own (so ctrl-a is 1 and 'a' is 97). Escape sequences are decoded into these keys. */
+enum {
+	RAW_KEY_UP = 256,
+	RAW_KEY_DOWN,
+	RAW_KEY_RIGHT,
+	RAW_KEY_LEFT,
+	RAW_KEY_HOME,
+	RAW_KEY_END,
+	RAW_KEY_INSERT,
+	RAW_KEY_DELETE,
+	RAW_KEY_PGUP,
+	RAW_KEY_PGDN,
+	RAW_KEY_CTRL_RIGHT,
+	RAW_KEY_CTRL_LEFT,
+	RAW_KEY_ESC, /* a lone escape (no sequence followed it before the timeout) */
+	RAW_KEY_UNKNOWN, /* an escape sequence which isn't known */
+
+	RAW_KEY_USER = 320, /* keys from RAW_KEY_USER up to RAW_KEY_MAX are free for use with raw_bind_seq() */
+	RAW_KEY_MAX = 384
+};
+
+/* Return values of key binding callbacks. */
+enum {
+	RAW_SUCCESS, /* the key was handled */
+	RAW_SILENT, /* the key did nothing */
+	RAW_BELL, /* the key did nothing, ring the terminal bell */
+	RAW_ENTER, /* accept the current line (like enter) */
+	RAW_ABORT /* abort the current line (like ctrl-c) */
+};
+
 /* Create new and free raw_t structures. */
 struct raw_t *raw_new(char *);
 void raw_free(struct raw_t *);
@@ -41,11 +75,66 @@ int raw_hist(struct raw_t *, bool, int); /* returns a negative int if an error o
 void raw_hist_add(struct raw_t *);
 void raw_hist_add_str(struct raw_t *, char *);
 char *raw_hist_get(struct raw_t *);
-int raw_hist_set(struct raw_t *, char *); /* returns a negative int if an error occured */
+int raw_hist_set(struct raw_t *, char *); /* replaces the history (growing its size to fit), returns a negative int if an error occured */
+
+/* Erase older duplicates of items added to history */
+int raw_hist_erasedups(struct raw_t *, bool); /* returns a negative int if an error occured */
+
+/* Only browse through history items starting with the line */
+int raw_hist_prefix(struct raw_t *, bool); /* returns a negative int if an error occured */
+
+/* Suggest the latest history item starting with the line while typing */
+int raw_hist_suggest(struct raw_t *, bool); /* returns a negative int if an error occured */
+
+/* Rank history items (for searching and suggestions) by how often and how recently they were used */
+int raw_hist_frecency(struct raw_t *, bool); /* returns a negative int if an error occured */
+
+/* Save history to (or load history from) a file descriptor or FILE, one item per line. Loading adds to the history
+ * (unlike raw_hist_set, it keeps the history size, so only the latest items of a longer file are kept). */
+int raw_hist_save(struct raw_t *, int); /* returns a negative int if an error occured */
+int raw_hist_fsave(struct raw_t *, FILE *); /* returns a negative int if an error occured */
+int raw_hist_load(struct raw_t *, int); /* returns a negative int if an error occured */
+int raw_hist_fload(struct raw_t *, FILE *); /* returns a negative int if an error occured */
+
+/* Save history to an indexed history file, or map one as the history (see README) */
+int raw_hist_save_index(struct raw_t *, int); /* returns a negative int if an error occured */
+int raw_hist_map(struct raw_t *, int); /* returns a negative int if an error occured */
+
+/* Append history to a journal shared between instances (see README), and compact it */
+int raw_hist_journal(struct raw_t *, char *, int); /* returns a negative int if an error occured */
+int raw_hist_journal_compact(struct raw_t *); /* returns a negative int if an error occured */
 
 /* Set completion (including callback) */
 int raw_comp(struct raw_t *, bool, char **(*callback)(char *), void (*cleanup)(char **)); /* returns a negative int if an error occured */
 
+/* Complete from a fixed corpus (copied and sorted once) as well as (or instead of) the callback */
+int raw_comp_corpus(struct raw_t *, bool, char **); /* returns a negative int if an error occured */
+
+/* Complete from a stream which emits candidates one at a time (raw_comp_emit returns non-zero once the stream can stop) */
+int raw_comp_stream(struct raw_t *, bool, void (*stream)(struct raw_t *, char *)); /* returns a negative int if an error occured */
+int raw_comp_emit(struct raw_t *, char *);
+
+/* Add (or remove) a provider of completion candidates, and run the providers on a pool of worker threads (with a deadline) */
+int raw_comp_provider(struct raw_t *, bool, char **(*callback)(char *), void (*cleanup)(char **)); /* returns a negative int if an error occured */
+int raw_comp_pool(struct raw_t *, bool, int, int); /* returns a negative int if an error occured */
+
+/* Keep handling keys while the providers run, and complete once they are done */
+int raw_comp_async(struct raw_t *, bool); /* returns a negative int if an error occured */
+
+/* Cache completion candidates between tab presses (see README), and throw away the cached candidates */
+int raw_comp_cache(struct raw_t *, bool, int); /* returns a negative int if an error occured */
+void raw_comp_cache_clear(struct raw_t *);
+
+/* Bind a callback to a key, and an escape sequence to a key */
+int raw_bind(struct raw_t *, int, int (*callback)(struct raw_t *, int)); /* returns a negative int if an error occured */
+int raw_bind_seq(struct raw_t *, char *, int); /* returns a negative int if an error occured */
+void raw_esc_timeout(struct raw_t *, int);
+
+/* Get, set and insert into the line being edited (for use by key binding callbacks) */
+char *raw_line_get(struct raw_t *, int *);
+void raw_line_set(struct raw_t *, char *, int);
+void raw_line_insert(struct raw_t *, char *);
+
 /* Returns a string taken from input, with emacs-like line editing (using give prompt). */
 char *raw_input(struct raw_t *, char*);
 #endif
@@ -51,6 +51,20 @@ void cleanup(char **table) {
 	free(table);
 } /* cleanup() */
 
+int kill_line(struct raw_t *raw, int key) {
+	int cursor;
+	char *line = raw_line_get(raw, &cursor);
+	(void) key;
+
+	/* nothing to kill */
+	if(!cursor)
+		return RAW_BELL;
+
+	/* kill everything before the cursor (like ctrl-u in bash) */
+	raw_line_set(raw, line + cursor, 0);
+	return RAW_SUCCESS;
+} /* kill_line() */
+
 #define EXAMPLE_HISTORY_SERIAL	"hello\n" \
 								"this\n" \
 								"is\n" \
@@ -67,6 +81,7 @@ int main(int argc, char **argv) {
    	raw = raw_new("exit");
 	raw_hist(raw, true, 2);
 	raw_comp(raw, true, callback, cleanup);
+	raw_bind(raw, 21, kill_line); /* ctrl-u */
 
 	raw_hist_set(raw, EXAMPLE_HISTORY_SERIAL);
 